@@ -21,7 +21,7 @@
 
 /* we know that the x86 can handle misalignment and has the "right" 
    byteorder */
-#ifdef __i386__
+#if defined(__i386__) || defined(__x86_64__)
 #define CAREFUL_ALIGNMENT 0
 #endif
 
@@ -19,12 +19,14 @@
 
 #include "rsync.h"
 
+extern int verbose;
+
 
 /*
   a simple 32 bit checksum that can be upadted from either end
   (inspired by Mark Adler's Adler-32 checksum)
   */
-uint32 get_checksum1(char *buf,int len)
+static uint32 get_checksum1_c(char *buf,int len)
 {
     int i;
     uint32 s1, s2;
@@ -37,42 +39,544 @@ uint32 get_checksum1(char *buf,int len)
     return (s1 & 0xffff) + (s2 << 16);
 }
 
+/*
+  roll a checksum of window length k forward ROLL_BATCH bytes.
+  s1v[0] and s2v[0] hold the running sums for the window at buf,
+  s1v[j] and s2v[j] are filled in for the window at buf+j. This
+  needs buf[0 .. k+ROLL_BATCH-1] to be valid
+  */
+static void roll_checksum1_c(char *buf,int k,uint32 *s1v,uint32 *s2v)
+{
+    int j;
+
+    for (j = 0; j < ROLL_BATCH; j++) {
+	s1v[j+1] = s1v[j] - buf[j] + buf[j+k];
+	s2v[j+1] = s2v[j] - k*buf[j] + s1v[j+1];
+    }
+}
+
+
+#if CHECKSUM_SIMD
+#include <immintrin.h>
+
+/*
+  the vector versions of get_checksum1(). Each pass over a stripe of
+  w bytes adds sum(x[k]) to s1 and 
+  w*s1 + sum((w-k)*x[k]) to s2. The bytes are sign extended to 16
+  bits so the results match the scalar loop over (signed) chars.
+  Everything is done mod 2^32 just like the scalar code, so there is
+  no need for the modulo reductions Adler-32 needs.
+  */
+__attribute__((target("sse2")))
+static uint32 get_checksum1_sse2(char *buf,int len)
+{
+    __m128i ones = _mm_set1_epi16(1);
+    __m128i wlo = _mm_set_epi16(9,10,11,12,13,14,15,16);
+    __m128i whi = _mm_set_epi16(1,2,3,4,5,6,7,8);
+    __m128i vs1 = _mm_setzero_si128();
+    __m128i vs2 = _mm_setzero_si128();
+    __m128i vps = _mm_setzero_si128();
+    uint32 t[4];
+    uint32 s1, s2;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+	__m128i x = _mm_loadu_si128((__m128i *)(buf+i));
+	__m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(x,x),8);
+	__m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(x,x),8);
+
+	vps = _mm_add_epi32(vps,vs1);
+	vs1 = _mm_add_epi32(vs1,_mm_add_epi32(_mm_madd_epi16(lo,ones),
+					      _mm_madd_epi16(hi,ones)));
+	vs2 = _mm_add_epi32(vs2,_mm_add_epi32(_mm_madd_epi16(lo,wlo),
+					      _mm_madd_epi16(hi,whi)));
+    }
+
+    vs2 = _mm_add_epi32(vs2,_mm_slli_epi32(vps,4));
+    _mm_storeu_si128((__m128i *)t,vs1);
+    s1 = t[0] + t[1] + t[2] + t[3];
+    _mm_storeu_si128((__m128i *)t,vs2);
+    s2 = t[0] + t[1] + t[2] + t[3];
+
+    for (; i < len; i++) {
+	s1 += buf[i];
+	s2 += s1;
+    }
+    return (s1 & 0xffff) + (s2 << 16);
+}
+
+__attribute__((target("avx2")))
+static uint32 get_checksum1_avx2(char *buf,int len)
+{
+    __m256i ones = _mm256_set1_epi16(1);
+    __m256i wlo = _mm256_set_epi16(17,18,19,20,21,22,23,24,
+				   25,26,27,28,29,30,31,32);
+    __m256i whi = _mm256_set_epi16(1,2,3,4,5,6,7,8,
+				   9,10,11,12,13,14,15,16);
+    __m256i vs1 = _mm256_setzero_si256();
+    __m256i vs2 = _mm256_setzero_si256();
+    __m256i vps = _mm256_setzero_si256();
+    uint32 t[8];
+    uint32 s1, s2;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+	__m256i lo = _mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i *)(buf+i)));
+	__m256i hi = _mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i *)(buf+i+16)));
+
+	vps = _mm256_add_epi32(vps,vs1);
+	vs1 = _mm256_add_epi32(vs1,_mm256_add_epi32(_mm256_madd_epi16(lo,ones),
+						    _mm256_madd_epi16(hi,ones)));
+	vs2 = _mm256_add_epi32(vs2,_mm256_add_epi32(_mm256_madd_epi16(lo,wlo),
+						    _mm256_madd_epi16(hi,whi)));
+    }
+
+    vs2 = _mm256_add_epi32(vs2,_mm256_slli_epi32(vps,5));
+    _mm256_storeu_si256((__m256i *)t,vs1);
+    s1 = t[0] + t[1] + t[2] + t[3] + t[4] + t[5] + t[6] + t[7];
+    _mm256_storeu_si256((__m256i *)t,vs2);
+    s2 = t[0] + t[1] + t[2] + t[3] + t[4] + t[5] + t[6] + t[7];
+
+    for (; i < len; i++) {
+	s1 += buf[i];
+	s2 += s1;
+    }
+    return (s1 & 0xffff) + (s2 << 16);
+}
+
+/* sign extend 4 chars to 4 ints */
+__attribute__((target("sse2")))
+static inline __m128i load4_sse2(char *p)
+{
+    int32 x;
+    __m128i v;
+
+    memcpy(&x,p,4);
+    v = _mm_cvtsi32_si128(x);
+    v = _mm_unpacklo_epi8(v,v);
+    v = _mm_unpacklo_epi16(v,v);
+    return _mm_srai_epi32(v,24);
+}
+
+/* low 32 bits of a 32x32 multiply in each lane, sse2 has no pmulld */
+__attribute__((target("sse2")))
+static inline __m128i mullo_sse2(__m128i a,__m128i b)
+{
+    __m128i even = _mm_mul_epu32(a,b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a,4),_mm_srli_si128(b,4));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even,_MM_SHUFFLE(0,0,2,0)),
+			      _mm_shuffle_epi32(odd,_MM_SHUFFLE(0,0,2,0)));
+}
+
+/* running sum across the 4 lanes */
+__attribute__((target("sse2")))
+static inline __m128i prefix_sse2(__m128i v)
+{
+    v = _mm_add_epi32(v,_mm_slli_si128(v,4));
+    return _mm_add_epi32(v,_mm_slli_si128(v,8));
+}
+
+/*
+  the rolling update done 4 offsets at a time: s1 at each offset is
+  the running sum of the byte differences and s2 the running sum of
+  s1 - k*(byte dropped)
+  */
+__attribute__((target("sse2")))
+static void roll_checksum1_sse2(char *buf,int k,uint32 *s1v,uint32 *s2v)
+{
+    __m128i vk = _mm_set1_epi32(k);
+    int j;
+
+    for (j = 0; j < ROLL_BATCH; j += 4) {
+	__m128i a = load4_sse2(buf+j);
+	__m128i b = load4_sse2(buf+j+k);
+	__m128i v1, v2;
+
+	v1 = prefix_sse2(_mm_sub_epi32(b,a));
+	v1 = _mm_add_epi32(v1,_mm_set1_epi32(s1v[j]));
+	v2 = prefix_sse2(_mm_sub_epi32(v1,mullo_sse2(vk,a)));
+	v2 = _mm_add_epi32(v2,_mm_set1_epi32(s2v[j]));
+	_mm_storeu_si128((__m128i *)(s1v+j+1),v1);
+	_mm_storeu_si128((__m128i *)(s2v+j+1),v2);
+    }
+}
+
+/*
+  MD4 over several buffers of the same length at once, one buffer in
+  each 32 bit lane of a vector. The rounds are those of MDblock() in
+  md4.c, written with gcc vector types so the same code serves the
+  4 lane sse2 and 8 lane avx2 versions.
+  */
+typedef uint32 md4_v4 __attribute__((vector_size(16)));
+typedef uint32 md4_v8 __attribute__((vector_size(32)));
+
+#define MD4_F(X,Y,Z) ((Z) ^ ((X) & ((Y) ^ (Z))))
+#define MD4_G(X,Y,Z) (((X) & (Y)) | ((Z) & ((X) | (Y))))
+#define MD4_H(X,Y,Z) ((X) ^ (Y) ^ (Z))
+#define MD4_ROT(X,S) (((X)<<(S)) | ((X)>>(32-(S))))
+#define MD4_FF(A,B,C,D,i,s) A += MD4_F(B,C,D) + W[i]; A = MD4_ROT(A,s)
+#define MD4_GG(A,B,C,D,i,s) A += MD4_G(B,C,D) + W[i] + 0x5a827999; A = MD4_ROT(A,s)
+#define MD4_HH(A,B,C,D,i,s) A += MD4_H(B,C,D) + W[i] + 0x6ed9eba1; A = MD4_ROT(A,s)
+
+#define MD4_ROUNDS \
+  MD4_FF(A,B,C,D, 0, 3); MD4_FF(D,A,B,C, 1, 7); \
+  MD4_FF(C,D,A,B, 2,11); MD4_FF(B,C,D,A, 3,19); \
+  MD4_FF(A,B,C,D, 4, 3); MD4_FF(D,A,B,C, 5, 7); \
+  MD4_FF(C,D,A,B, 6,11); MD4_FF(B,C,D,A, 7,19); \
+  MD4_FF(A,B,C,D, 8, 3); MD4_FF(D,A,B,C, 9, 7); \
+  MD4_FF(C,D,A,B,10,11); MD4_FF(B,C,D,A,11,19); \
+  MD4_FF(A,B,C,D,12, 3); MD4_FF(D,A,B,C,13, 7); \
+  MD4_FF(C,D,A,B,14,11); MD4_FF(B,C,D,A,15,19); \
+  MD4_GG(A,B,C,D, 0, 3); MD4_GG(D,A,B,C, 4, 5); \
+  MD4_GG(C,D,A,B, 8, 9); MD4_GG(B,C,D,A,12,13); \
+  MD4_GG(A,B,C,D, 1, 3); MD4_GG(D,A,B,C, 5, 5); \
+  MD4_GG(C,D,A,B, 9, 9); MD4_GG(B,C,D,A,13,13); \
+  MD4_GG(A,B,C,D, 2, 3); MD4_GG(D,A,B,C, 6, 5); \
+  MD4_GG(C,D,A,B,10, 9); MD4_GG(B,C,D,A,14,13); \
+  MD4_GG(A,B,C,D, 3, 3); MD4_GG(D,A,B,C, 7, 5); \
+  MD4_GG(C,D,A,B,11, 9); MD4_GG(B,C,D,A,15,13); \
+  MD4_HH(A,B,C,D, 0, 3); MD4_HH(D,A,B,C, 8, 9); \
+  MD4_HH(C,D,A,B, 4,11); MD4_HH(B,C,D,A,12,15); \
+  MD4_HH(A,B,C,D, 2, 3); MD4_HH(D,A,B,C,10, 9); \
+  MD4_HH(C,D,A,B, 6,11); MD4_HH(B,C,D,A,14,15); \
+  MD4_HH(A,B,C,D, 1, 3); MD4_HH(D,A,B,C, 9, 9); \
+  MD4_HH(C,D,A,B, 5,11); MD4_HH(B,C,D,A,13,15); \
+  MD4_HH(A,B,C,D, 3, 3); MD4_HH(D,A,B,C,11, 9); \
+  MD4_HH(C,D,A,B, 7,11); MD4_HH(B,C,D,A,15,15)
+
+/*
+  build the padded final block(s) of a len byte message, returning
+  how many bytes of tail there are (64 or 128)
+  */
+static int md4_tail(char *buf,int len,char *tail)
+{
+  int r = len & 63;
+  int n = r < 56 ? 64 : 128;
+
+  memcpy(tail,buf+len-r,r);
+  tail[r] = 0x80;
+  bzero(tail+r+1,n-r-1);
+  SIVAL(tail,n-8,(uint32)len<<3);
+  SIVAL(tail,n-4,(uint32)len>>29);
+  return n;
+}
+
+/* the 64 byte block at ofs in each lane's buffer, gathered lane by lane */
+#define MD4_LANE_BLOCK(vtype,lanes,bufs,ofs) do { \
+  vtype W[16], AA = A, BB = B, CC = C, DD = D; \
+  int md4_w, md4_l; \
+  for (md4_w=0;md4_w<16;md4_w++) \
+    for (md4_l=0;md4_l<lanes;md4_l++) \
+      W[md4_w][md4_l] = IVAL((bufs)[md4_l]+(ofs),md4_w*4); \
+  MD4_ROUNDS; \
+  A += AA; B += BB; C += CC; D += DD; \
+} while (0)
+
+#define MD4_LANES(name,vtype,lanes,isa) \
+__attribute__((target(isa))) \
+static void name(char **bufs,int len,char **sums) \
+{ \
+  vtype A, B, C, D; \
+  char tail[lanes][128]; \
+  int i, l, n = 0; \
+ \
+  A = (vtype){0} + 0x67452301; \
+  B = (vtype){0} + 0xefcdab89; \
+  C = (vtype){0} + 0x98badcfe; \
+  D = (vtype){0} + 0x10325476; \
+ \
+  for (i = 0; i + 64 <= len; i += 64) \
+    MD4_LANE_BLOCK(vtype,lanes,bufs,i); \
+ \
+  for (l=0;l<lanes;l++) \
+    n = md4_tail(bufs[l],len,tail[l]); \
+  for (i = 0; i < n; i += 64) \
+    MD4_LANE_BLOCK(vtype,lanes,tail,i); \
+ \
+  for (l=0;l<lanes;l++) { \
+    SIVAL(sums[l],0,A[l]); \
+    SIVAL(sums[l],4,B[l]); \
+    SIVAL(sums[l],8,C[l]); \
+    SIVAL(sums[l],12,D[l]); \
+  } \
+}
+
+MD4_LANES(get_checksum2_sse2,md4_v4,4,"sse2")
+MD4_LANES(get_checksum2_avx2,md4_v8,8,"avx2")
+#endif
+
+static uint32 (*checksum1_fn)(char *,int) = NULL;
+static void (*roll_fn)(char *,int,uint32 *,uint32 *) = NULL;
+static void (*checksum2_fn)(char **,int,char **) = NULL;
+static int checksum2_lanes = 1;
+
+/*
+  pick the fastest checksum code the cpu supports. The vector
+  checksum1 code assumes chars are signed, as they are on x86 by
+  default
+  */
+void checksum_init(void)
+{
+  uint32 (*fn)(char *,int) = get_checksum1_c;
+  void (*rfn)(char *,int,uint32 *,uint32 *) = roll_checksum1_c;
+  char *name = "C";
+  char *name2 = "C";
+
+#if CHECKSUM_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    checksum2_fn = get_checksum2_sse2;
+    checksum2_lanes = 4;
+    name2 = "SSE2";
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    checksum2_fn = get_checksum2_avx2;
+    checksum2_lanes = 8;
+    name2 = "AVX2";
+  }
+  if ((char)-1 < 0) {
+    if (__builtin_cpu_supports("sse2")) {
+      fn = get_checksum1_sse2;
+      rfn = roll_checksum1_sse2;
+      name = "SSE2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      fn = get_checksum1_avx2;
+      name = "AVX2";
+    }
+  }
+#endif
+
+  if (verbose > 3)
+    fprintf(stderr,"checksum1 using %s code, checksum2 using %s code\n",
+	    name,name2);
+
+  roll_fn = rfn;
+  checksum1_fn = fn;
+}
+
+uint32 get_checksum1(char *buf,int len)
+{
+  if (!checksum1_fn)
+    checksum_init();
+  return checksum1_fn(buf,len);
+}
+
+void roll_checksum1(char *buf,int k,uint32 *s1v,uint32 *s2v)
+{
+  if (!roll_fn)
+    checksum_init();
+  roll_fn(buf,k,s1v,s2v);
+}
+
+/*
+  content defined chunking. A gear hash (shift left, add a random value
+  for the byte) depends only on the last 32 bytes, so a chunk ends
+  where the hash's top bits are all zero wherever the data has moved
+  to. Chunks are between n/4 and 4n bytes. As in FastCDC a stricter
+  mask is used before n bytes and a looser one after, which pulls the
+  sizes in towards n
+  */
+static uint32 gear[256];
+
+static void gear_init(void)
+{
+  uint32 x = 0x9e3779b9;
+  int i;
+
+  for (i=0;i<256;i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    gear[i] = x;
+  }
+}
+
+/* the length of the chunk that starts at buf, len bytes are left */
+int cdc_next(char *buf,int len,int n)
+{
+  uint32 h = 0, mask;
+  int i, bits, max = MIN(len,4*n);
+
+  if (len <= n/4)
+    return len;
+
+  if (!gear[0])
+    gear_init();
+
+  for (bits=2; (2<<bits) <= n; bits++) ;
+
+  mask = ~(uint32)0 << (32-(bits+1));
+  for (i=n/4; i<MIN(n,max); i++) {
+    h = (h << 1) + gear[(uchar)buf[i]];
+    if (!(h & mask))
+      return i+1;
+  }
+
+  mask = ~(uint32)0 << (32-(bits-1));
+  for (; i<max; i++) {
+    h = (h << 1) + gear[(uchar)buf[i]];
+    if (!(h & mask))
+      return i+1;
+  }
+
+  return max;
+}
+
 // 使用md4计算checksum
+/*
+  the full 64 byte blocks are hashed in place, only the tail is
+  copied (by MDupdate) so it can be padded
+  */
 void get_checksum2(char *buf,int len,char *sum)
 {
-  char buf2[64];
   int i;
   MDstruct MD;
 
   MDbegin(&MD);
   for(i = 0; i + 64 <= len; i += 64) {
-    bcopy(buf+i,buf2,64);
-    MDupdate(&MD, buf2, 512);
+    MDupdate(&MD, buf+i, 512);
   }
-  bcopy(buf+i,buf2,len-i);
-  MDupdate(&MD, buf2, (len-i)*8);
+  MDupdate(&MD, buf+i, (len-i)*8);
   SIVAL(sum,0,MD.buffer[0]);
   SIVAL(sum,4,MD.buffer[1]);
   SIVAL(sum,8,MD.buffer[2]);
   SIVAL(sum,12,MD.buffer[3]);
 }
 
-void file_checksum(char *fname,char *sum,off_t size)
+/*
+  the strong checksums of count buffers, sums[i] gets the digest of
+  bufs[i]. Runs of buffers with the same length (all the blocks of a
+  file bar the last) are hashed several at a time, anything left
+  over goes through get_checksum2()
+  */
+void get_checksum2_multi(int count,char **bufs,int *lens,char **sums)
 {
-  char *buf;
-  int fd;
+  int i = 0, j;
+
+  if (!checksum1_fn)
+    checksum_init();
+
+  while (i < count) {
+    if (checksum2_lanes > 1 && i + checksum2_lanes <= count) {
+      for (j=1;j<checksum2_lanes && lens[i+j]==lens[i];j++) ;
+      if (j == checksum2_lanes) {
+	checksum2_fn(bufs+i,lens[i],sums+i);
+	i += j;
+	continue;
+      }
+    }
+    get_checksum2(bufs[i],lens[i],sums[i]);
+    i++;
+  }
+}
+
+/*
+  a whole file checksum built up a piece at a time, as the receiver
+  writes the file out. Only the partial block at the end of each
+  piece is copied
+  */
+static MDstruct sumMD;
+static int sumresidue;
+static char sumrbuf[64];
+
+void sum_init(void)
+{
+  MDbegin(&sumMD);
+  sumresidue = 0;
+}
+
+void sum_update(char *p,int len)
+{
+  int i;
+
+  if (sumresidue + len < 64) {
+    bcopy(p,sumrbuf+sumresidue,len);
+    sumresidue += len;
+    return;
+  }
+
+  if (sumresidue) {
+    i = 64 - sumresidue;
+    bcopy(p,sumrbuf+sumresidue,i);
+    MDupdate(&sumMD, sumrbuf, 512);
+    p += i;
+    len -= i;
+  }
+
+  for (i = 0; i + 64 <= len; i += 64)
+    MDupdate(&sumMD, p+i, 512);
+
+  sumresidue = len - i;
+  bcopy(p+i,sumrbuf,sumresidue);
+}
+
+void sum_end(char *sum)
+{
+  MDupdate(&sumMD, sumrbuf, sumresidue*8);
+  SIVAL(sum,0,sumMD.buffer[0]);
+  SIVAL(sum,4,sumMD.buffer[1]);
+  SIVAL(sum,8,sumMD.buffer[2]);
+  SIVAL(sum,12,sumMD.buffer[3]);
+}
+
+/*
+  the MD4 of a whole file, or zeros and a return of 0 if it can't be
+  read. This is called from the -c checksum threads, so it must not
+  touch any shared state. The file may be bigger than an int, so it
+  is summed a window at a time, letting go of each window after
+  */
+int compute_file_checksum(char *fname,char *sum,off_t size)
+{
+  struct map_struct *map;
+  char *p;
+  int fd, i, n, ok;
+  off_t w;
+  MDstruct MD;
+
   bzero(sum,SUM_LENGTH);
 
   fd = open(fname,O_RDONLY);
-  if (fd == -1) return;
+  if (fd == -1) return 0;
 
-  buf = map_file(fd,size);
-  if (!buf) {
+  map = map_file(fd,size);
+  if (!map) {
     close(fd);
-    return;
+    return 0;
   }
 
-  get_checksum2(buf,size,sum);
+  MDbegin(&MD);
+  for (w = 0; ; w += n) {
+    n = MIN(size-w,MAP_WINDOW);
+    p = map_ptr(map,w,n);
+    for (i = 0; i + 64 <= n; i += 64)
+      MDupdate(&MD, p+i, 512);
+    if (w + n == size) {
+      MDupdate(&MD, p+i, (n-i)*8);
+      break;
+    }
+    map_release(map,w,n);
+  }
+  SIVAL(sum,0,MD.buffer[0]);
+  SIVAL(sum,4,MD.buffer[1]);
+  SIVAL(sum,8,MD.buffer[2]);
+  SIVAL(sum,12,MD.buffer[3]);
+
+  ok = !map->short_read;
+  unmap_file(map);
   close(fd);
-  unmap_file(buf,size);
+  return ok;
+}
+
+/*
+  the MD4 of a whole file, from the -c index if the file has not
+  changed since it was last summed
+  */
+void file_checksum(char *fname,char *sum,struct stat *st)
+{
+  if (file_sum_lookup(st,sum))
+    return;
+
+  if (compute_file_checksum(fname,sum,st->st_size))
+    file_sum_store(st,sum);
 }
@@ -0,0 +1,235 @@
+/*
+   Copyright (C) Andrew Tridgell 1996
+   Copyright (C) Paul Mackerras 1996
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+  checks the vector checksum code against the plain C versions. The
+  vector functions are static so checksum.c is pulled in whole. Run
+  with "make test", "make bench" times the multi lane MD4 code
+  */
+#include "checksum.c"
+
+int verbose = 0;
+int read_mode = READ_MMAP;
+
+/* the checksum cache isn't wanted here */
+int file_sum_lookup(struct stat *st,char *sum) { return 0; }
+void file_sum_store(struct stat *st,char *sum) { }
+
+#define TEST_BUF (64*1024)
+#define TEST_ROUNDS 20000
+
+static int failures = 0;
+
+static void fail(char *what,int off,int len)
+{
+  fprintf(stderr,"%s differs at offset %d length %d\n",what,off,len);
+  failures++;
+}
+
+static void window_sums(char *buf,int k,uint32 *s1,uint32 *s2)
+{
+  int i;
+
+  *s1 = *s2 = 0;
+  for (i=0;i<k;i++) {
+    *s1 += buf[i];
+    *s2 += *s1;
+  }
+}
+
+#if CHECKSUM_SIMD
+static void test_checksum1(char *buf)
+{
+  int avx2 = __builtin_cpu_supports("avx2");
+  int i;
+
+  for (i=0;i<TEST_ROUNDS;i++) {
+    int off = random() % 64;
+    int len = (i & 1) ? random() % 256 : random() % (TEST_BUF - 64);
+    uint32 sum = get_checksum1_c(buf+off,len);
+
+    if (get_checksum1_sse2(buf+off,len) != sum)
+      fail("get_checksum1_sse2",off,len);
+    if (avx2 && get_checksum1_avx2(buf+off,len) != sum)
+      fail("get_checksum1_avx2",off,len);
+  }
+}
+
+static void test_roll(char *buf)
+{
+  uint32 s1v[ROLL_BATCH+1], s2v[ROLL_BATCH+1];
+  uint32 c1v[ROLL_BATCH+1], c2v[ROLL_BATCH+1];
+  int i, j;
+
+  for (i=0;i<TEST_ROUNDS;i++) {
+    int k = 1 + random() % 4096;
+    int off = random() % (TEST_BUF - k - ROLL_BATCH);
+
+    window_sums(buf+off,k,&s1v[0],&s2v[0]);
+    c1v[0] = s1v[0];
+    c2v[0] = s2v[0];
+    roll_checksum1_sse2(buf+off,k,s1v,s2v);
+    roll_checksum1_c(buf+off,k,c1v,c2v);
+    for (j=1;j<=ROLL_BATCH;j++) {
+      if (s1v[j] != c1v[j] || s2v[j] != c2v[j]) {
+	fail("roll_checksum1_sse2",off+j,k);
+	break;
+      }
+      if ((c1v[j] & 0xffff) + (c2v[j] << 16) !=
+	  get_checksum1_c(buf+off+j,k)) {
+	fail("roll_checksum1_c",off+j,k);
+	break;
+      }
+    }
+  }
+}
+
+static void test_checksum2(char *buf)
+{
+  char *bufs[8], *sums[8];
+  char sum[8][SUM_LENGTH], want[SUM_LENGTH];
+  int avx2 = __builtin_cpu_supports("avx2");
+  int i, j;
+
+  for (j=0;j<8;j++)
+    sums[j] = sum[j];
+
+  for (i=0;i<TEST_ROUNDS/8;i++) {
+    int len = (i & 1) ? random() % 200 : random() % 8192;
+
+    for (j=0;j<8;j++)
+      bufs[j] = buf + random() % (TEST_BUF - len);
+
+    get_checksum2_sse2(bufs,len,sums);
+    for (j=0;j<4;j++) {
+      get_checksum2(bufs[j],len,want);
+      if (memcmp(sum[j],want,SUM_LENGTH) != 0)
+	fail("get_checksum2_sse2",bufs[j]-buf,len);
+    }
+    if (!avx2) continue;
+    get_checksum2_avx2(bufs,len,sums);
+    for (j=0;j<8;j++) {
+      get_checksum2(bufs[j],len,want);
+      if (memcmp(sum[j],want,SUM_LENGTH) != 0)
+	fail("get_checksum2_avx2",bufs[j]-buf,len);
+    }
+  }
+}
+
+static double elapsed(struct timeval *t0)
+{
+  struct timeval t1;
+  gettimeofday(&t1,NULL);
+  return (t1.tv_sec - t0->tv_sec) + (t1.tv_usec - t0->tv_usec)/1.0e6;
+}
+
+/*
+  MB/s of the strong checksum over every block of the buffer, one
+  block at a time and then lanes blocks at a time
+  */
+static void bench_checksum2(char *buf,int blen)
+{
+  int nblocks = TEST_BUF / blen;
+  char *bufs[8], *sums[8];
+  char sum[8][SUM_LENGTH];
+  struct timeval t0;
+  int i, j, pass, passes = 10000;
+  double t, mb = (double)nblocks*blen*passes/(1024*1024);
+
+  for (j=0;j<8;j++)
+    sums[j] = sum[j];
+
+  gettimeofday(&t0,NULL);
+  for (pass=0;pass<passes;pass++)
+    for (i=0;i<nblocks;i++)
+      get_checksum2(buf+i*blen,blen,sum[0]);
+  t = elapsed(&t0);
+  printf("block %5d  C    %8.1f MB/s\n",blen,mb/t);
+
+  gettimeofday(&t0,NULL);
+  for (pass=0;pass<passes;pass++)
+    for (i=0;i+4<=nblocks;i+=4) {
+      for (j=0;j<4;j++)
+	bufs[j] = buf+(i+j)*blen;
+      get_checksum2_sse2(bufs,blen,sums);
+    }
+  t = elapsed(&t0);
+  printf("block %5d  SSE2 %8.1f MB/s\n",blen,mb/t);
+
+  if (!__builtin_cpu_supports("avx2")) return;
+
+  gettimeofday(&t0,NULL);
+  for (pass=0;pass<passes;pass++)
+    for (i=0;i+8<=nblocks;i+=8) {
+      for (j=0;j<8;j++)
+	bufs[j] = buf+(i+j)*blen;
+      get_checksum2_avx2(bufs,blen,sums);
+    }
+  t = elapsed(&t0);
+  printf("block %5d  AVX2 %8.1f MB/s\n",blen,mb/t);
+}
+#endif
+
+int main(int argc,char *argv[])
+{
+  char *buf;
+  int i, bench = 0;
+
+  if (argc > 1 && strcmp(argv[1],"bench") == 0) {
+    bench = 1;
+    argc--; argv++;
+  }
+
+  buf = (char *)malloc(TEST_BUF);
+  if (!buf) out_of_memory("checktest");
+
+  srandom(argc > 1 ? atoi(argv[1]) : time(NULL));
+  for (i=0;i<TEST_BUF;i++)
+    buf[i] = random();
+
+#if CHECKSUM_SIMD
+  __builtin_cpu_init();
+  if (bench) {
+    if (__builtin_cpu_supports("sse2")) {
+      bench_checksum2(buf,700);
+      bench_checksum2(buf,8192);
+    } else {
+      printf("no vector checksum2 code on this machine\n");
+    }
+    return 0;
+  }
+  if ((char)-1 < 0 && __builtin_cpu_supports("sse2")) {
+    test_checksum1(buf);
+    test_roll(buf);
+  } else {
+    printf("no vector checksum1 code on this machine\n");
+  }
+  if (__builtin_cpu_supports("sse2"))
+    test_checksum2(buf);
+#else
+  printf("built without the vector checksum code\n");
+#endif
+
+  if (failures) {
+    printf("checktest: %d failures\n",failures);
+    exit(1);
+  }
+  printf("checktest: ok\n");
+  return 0;
+}
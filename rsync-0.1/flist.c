@@ -23,6 +23,7 @@
 
 extern int verbose;
 extern int always_checksum;
+extern int num_threads;
 extern off_t total_size;
 
 extern int make_backups;
@@ -49,8 +50,6 @@ static int match_file_name(char *fname,struct stat *st)
 
 
 
-static void send_directory(int f,struct file_list *flist,char *dir);
-
 static char *flist_dir = NULL;
 
 // 将 file_struct 写入给到对端
@@ -58,8 +57,8 @@ static void send_file_entry(struct file_struct *file,int f)
 {
   write_int(f,strlen(file->name));
   write_buf(f,file->name,strlen(file->name));
-  write_int(f,(int)file->modtime);
-  write_int(f,(int)file->length);
+  write_longint(f,(int64)file->modtime);
+  write_longint(f,(int64)file->length);
   write_int(f,(int)file->mode);
   if (preserve_uid)
     write_int(f,(int)file->uid);
@@ -84,6 +83,153 @@ static void send_file_entry(struct file_struct *file,int f)
 }
 
 
+/*
+  with -c and -j the whole file checksums are worked out by
+  num_threads threads while the walk carries on, so reading one file
+  overlaps with hashing others. Entries go into flist as they are
+  made but are sent in order, once their checksums are in. At most
+  CSUM_QUEUE files are waiting for a thread at a time.
+
+  Jobs are numbered in the order they are queued, job n lives in
+  csum_queue[n % CSUM_QUEUE]
+  */
+struct csum_job {
+  int index;			/* of the file in flist */
+  char *fname;
+  struct stat st;
+  char sum[SUM_LENGTH];
+  int ok, done;
+};
+
+static struct csum_job csum_queue[CSUM_QUEUE];
+static int csum_head, csum_next, csum_tail; /* oldest, next to start, next free */
+static int csum_quit;
+static pthread_t *csum_tids;
+static int csum_nthreads;
+static pthread_mutex_t csum_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t csum_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t csum_done = PTHREAD_COND_INITIALIZER;
+
+static int flist_sent;		/* entries of flist sent so far */
+static int csum_wanted;		/* make_file() left the sum to a thread */
+static struct stat csum_st;
+
+static void *csum_worker(void *arg)
+{
+  struct csum_job *job;
+
+  pthread_mutex_lock(&csum_lock);
+  while (1) {
+    while (csum_next == csum_tail && !csum_quit)
+      pthread_cond_wait(&csum_work,&csum_lock);
+    if (csum_next == csum_tail)
+      break;
+    job = &csum_queue[csum_next++ % CSUM_QUEUE];
+    pthread_mutex_unlock(&csum_lock);
+
+    job->ok = compute_file_checksum(job->fname,job->sum,job->st.st_size);
+
+    pthread_mutex_lock(&csum_lock);
+    job->done = 1;
+    pthread_cond_signal(&csum_done);
+  }
+  pthread_mutex_unlock(&csum_lock);
+  return NULL;
+}
+
+/*
+  send the entries of flist that are ready, in order. If wait is set
+  this waits for the checksums still being worked out and sends the
+  lot
+  */
+static void send_ready(int f,struct file_list *flist,int wait)
+{
+  struct csum_job *job;
+
+  pthread_mutex_lock(&csum_lock);
+  while (flist_sent < flist->count) {
+    job = &csum_queue[csum_head % CSUM_QUEUE];
+    if (csum_head != csum_tail && job->index == flist_sent) {
+      if (!job->done) {
+	if (!wait) break;
+	pthread_cond_wait(&csum_done,&csum_lock);
+	continue;
+      }
+      bcopy(job->sum,flist->files[flist_sent].sum,SUM_LENGTH);
+      if (job->ok)
+	file_sum_store(&job->st,job->sum);
+      free(job->fname);
+      csum_head++;
+    }
+    pthread_mutex_unlock(&csum_lock);
+    send_file_entry(&flist->files[flist_sent++],f);
+    pthread_mutex_lock(&csum_lock);
+  }
+  pthread_mutex_unlock(&csum_lock);
+}
+
+static void queue_checksum(int f,struct file_list *flist,char *fname)
+{
+  struct csum_job *job;
+
+  if (!csum_tids) {
+    csum_tids = (pthread_t *)malloc(sizeof(csum_tids[0])*num_threads);
+    if (!csum_tids) out_of_memory("queue_checksum");
+    checksum_init();
+    for (csum_nthreads=0; csum_nthreads<num_threads; csum_nthreads++)
+      if (pthread_create(&csum_tids[csum_nthreads],NULL,
+			 csum_worker,NULL) != 0)
+	break;
+    if (csum_nthreads == 0) {
+      fprintf(stderr,"failed to start checksum threads\n");
+      exit(1);
+    }
+  }
+
+  /* wait for the oldest job to finish if the queue is full */
+  pthread_mutex_lock(&csum_lock);
+  while (csum_tail - csum_head == CSUM_QUEUE) {
+    pthread_mutex_unlock(&csum_lock);
+    send_ready(f,flist,0);
+    pthread_mutex_lock(&csum_lock);
+    if (csum_tail - csum_head == CSUM_QUEUE &&
+	!csum_queue[csum_head % CSUM_QUEUE].done)
+      pthread_cond_wait(&csum_done,&csum_lock);
+  }
+
+  job = &csum_queue[csum_tail % CSUM_QUEUE];
+  job->index = flist->count;
+  job->fname = strdup(fname);
+  if (!job->fname) out_of_memory("queue_checksum");
+  job->st = csum_st;
+  job->ok = job->done = 0;
+  csum_tail++;
+  pthread_cond_signal(&csum_work);
+  pthread_mutex_unlock(&csum_lock);
+}
+
+/* send everything still waiting, before a chdir or at the end */
+static void send_all(int f,struct file_list *flist)
+{
+  send_ready(f,flist,1);
+}
+
+static void stop_checksums(void)
+{
+  if (!csum_tids) return;
+
+  pthread_mutex_lock(&csum_lock);
+  csum_quit = 1;
+  pthread_cond_broadcast(&csum_work);
+  pthread_mutex_unlock(&csum_lock);
+
+  while (csum_nthreads--)
+    pthread_join(csum_tids[csum_nthreads],NULL);
+  free(csum_tids);
+  csum_tids = NULL;
+}
+
+
 // 将文件属性都存放到 file_struct
 static struct file_struct *make_file(int recurse,char *fname)
 {
@@ -133,8 +279,19 @@ static struct file_struct *make_file(int recurse,char *fname)
   }
 #endif
 
+  /* with -j the checksum threads sum the file if the index doesn't
+     have it, see queue_checksum() */
+  csum_wanted = 0;
   if (always_checksum && S_ISREG(st.st_mode)) {
-    file_checksum(fname,file.sum,st.st_size);
+    if (num_threads > 1) {
+      bzero(file.sum,SUM_LENGTH);
+      if (!file_sum_lookup(&st,file.sum)) {
+	csum_wanted = 1;
+	csum_st = st;
+      }
+    } else {
+      file_checksum(fname,file.sum,&st);
+    }
   }       
 
   if (flist_dir)
@@ -149,7 +306,81 @@ static struct file_struct *make_file(int recurse,char *fname)
 }
 
 
-static int flist_malloced;
+/* room for one more entry in flist */
+static void grow_flist(struct file_list *flist)
+{
+  if (flist->count < flist->malloced) return;
+  flist->malloced = flist->malloced ? flist->malloced*2 : 100;
+  flist->files = (struct file_struct *)realloc(flist->files,
+					       sizeof(flist->files[0])*
+					       flist->malloced);
+  if (!flist->files)
+    out_of_memory("grow_flist");
+}
+
+static struct file_list *new_flist(void)
+{
+  struct file_list *flist;
+
+  flist = (struct file_list *)malloc(sizeof(flist[0]));
+  if (!flist) out_of_memory("new_flist");
+  flist->count = 0;
+  flist->malloced = 0;
+  flist->files = NULL;
+  grow_flist(flist);
+  return flist;
+}
+
+/* the bytes send_file_entry() writes for file */
+static int file_entry_size(struct file_struct *file)
+{
+  int len = 4 + strlen(file->name) + 8 + 8 + 4;
+
+  if (preserve_uid) len += 4;
+  if (preserve_gid) len += 4;
+  if (preserve_devices) len += 4;
+#if SUPPORT_LINKS
+  if (preserve_links && S_ISLNK(file->mode))
+    len += 4 + strlen(file->link);
+#endif
+  if (always_checksum) len += SUM_LENGTH;
+  return len;
+}
+
+
+/*
+  the directories still to be walked, innermost last. The first
+  segment of the file list is just the names given on the command
+  line. The rest of the walk is done a segment at a time as the
+  generator asks for them, so the transfer starts straight away and
+  the walk only keeps a segment ahead of it. A directory is opened
+  when the walk gets to it and may be left part way through when a
+  segment fills up
+  */
+struct walk_dir {
+  char *name;			/* as it is in the file list */
+  char *base;			/* the flist_dir of its entries */
+  DIR *d;
+};
+
+static struct walk_dir *walk = NULL;
+static int walk_count, walk_size;
+static char *walk_base;		/* the base the walk has changed to */
+static char walk_home[MAXPATHLEN]; /* the directory it started from */
+static int segment_bytes;	/* sent in this segment so far */
+
+static void push_dir(char *name,char *base)
+{
+  if (walk_count == walk_size) {
+    walk_size = walk_size ? walk_size*2 : 16;
+    walk = (struct walk_dir *)realloc(walk,sizeof(walk[0])*walk_size);
+    if (!walk) out_of_memory("push_dir");
+  }
+  walk[walk_count].name = name;
+  walk[walk_count].base = base;
+  walk[walk_count].d = NULL;
+  walk_count++;
+}
 
 static void send_file_name(int f,struct file_list *flist,
 			   int recurse,char *fname)
@@ -161,82 +392,116 @@ static void send_file_name(int f,struct file_list *flist,
 
   if (!file) return;
   
-  // 预先分配的内存不够，再多分配点
-  if (flist->count >= flist_malloced) {
-    flist_malloced += 100;
-    flist->files = (struct file_struct *)realloc(flist->files,
-						 sizeof(flist->files[0])*
-						 flist_malloced);
-    if (!flist->files)
-      out_of_memory("send_file_name");
-  }
+  /* the job goes in first, a full queue sends what is ready and that
+     mustn't include this entry */
+  if (csum_wanted)
+    queue_checksum(f,flist,fname);
 
+  grow_flist(flist);
   flist->files[flist->count++] = *file;    
-
+  segment_bytes += file_entry_size(file);
   
   // file->dir 没有从这里写到 f
-  send_file_entry(file,f);
+  send_ready(f,flist,0);
 
-  // dir 是这里处理
-  if (S_ISDIR(file->mode) && recurse) {      
-    send_directory(f,flist,file->name);
-    return;
-  }
+  // 目录的内容在后面的 segment 里
+  if (S_ISDIR(file->mode) && recurse)
+    push_dir(file->name,flist_dir);
 }
 
+/* change to the directory the names in w are relative to. Returns 0
+   if that can't be done */
+static int walk_chdir(int f,struct file_list *flist,struct walk_dir *w)
+{
+  if (w->base == walk_base)
+    return 1;
 
+  send_all(f,flist);
+  if (walk_base && chdir(walk_home) != 0) {
+    fprintf(stderr,"chdir %s : %s\n",walk_home,strerror(errno));
+    exit(1);
+  }
+  walk_base = NULL;
+  if (w->base && chdir(w->base) != 0) {
+    fprintf(stderr,"chdir %s : %s\n",w->base,strerror(errno));
+    return 0;
+  }
+  walk_base = w->base;
+  return 1;
+}
 
-static void send_directory(int f,struct file_list *flist,char *dir)
+/* walk on until the segment is full or there is nothing left */
+static void walk_dirs(int f,struct file_list *flist)
 {
-  DIR *d;
+  struct walk_dir *w;
   struct dirent *di;
   char fname[MAXPATHLEN];
   int l;
-  char *p;
 
-  d = opendir(dir);
-  if (!d) {
-    fprintf(stderr,"%s: %s\n",
-	    dir,strerror(errno));
-    return;
-  }
+  while (walk_count > 0 && segment_bytes < FLIST_SEGMENT_SIZE) {
+    w = &walk[walk_count-1];
 
-  strcpy(fname,dir);
-  l = strlen(fname);
-  if (fname[l-1] != '/')
-    strcat(fname,"/");
-  p = fname + strlen(fname);
-  
-  // 遍历目录所有文件
-  for (di=readdir(d); di; di=readdir(d)) {
+    if (!walk_chdir(f,flist,w)) {
+      if (w->d) closedir(w->d);
+      walk_count--;
+      continue;
+    }
+    if (!w->d && !(w->d = opendir(w->name))) {
+      fprintf(stderr,"%s: %s\n",w->name,strerror(errno));
+      walk_count--;
+      continue;
+    }
+
+    di = readdir(w->d);
+    if (!di) {
+      closedir(w->d);
+      walk_count--;
+      continue;
+    }
     if (strcmp(di->d_name,".")==0 ||
 	strcmp(di->d_name,"..")==0)
       continue;
-    strcpy(p,di->d_name);
+
+    strcpy(fname,w->name);
+    l = strlen(fname);
+    if (fname[l-1] != '/')
+      strcat(fname,"/");
+    strcat(fname,di->d_name);
+
+    flist_dir = w->base;
     send_file_name(f,flist,1,fname);
+    flist_dir = NULL;
   }
 
-  closedir(d);
+  /* the entries still waiting for checksums have names relative to
+     here */
+  send_all(f,flist);
+  if (walk_base) {
+    if (chdir(walk_home) != 0) {
+      fprintf(stderr,"chdir %s : %s\n",walk_home,strerror(errno));
+      exit(1);
+    }
+    walk_base = NULL;
+  }
 }
 
 
-
+/*
+  send the first segment of the file list, the names given. Any
+  directories among them are walked later by send_flist_segment()
+  */
 struct file_list *send_file_list(int f,int recurse,int argc,char *argv[])
 {
   int i,l;
   struct stat st;
+  struct walk_dir w;
   char *p,*dir;
   char dbuf[MAXPATHLEN];
   struct file_list *flist;
 
-  flist = (struct file_list *)malloc(sizeof(flist[0]));
-  if (!flist) out_of_memory("send_file_list");
-
-  flist->count=0;
-  flist_malloced = 100;
-  flist->files = (struct file_struct *)malloc(sizeof(flist->files[0])*
-					      flist_malloced);
-  if (!flist->files) out_of_memory("send_file_list");
+  flist = new_flist();
+  flist_sent = 0;
+  walk_count = 0;
 
   // argc 1
   // argv /root/test1/xintest1_file
@@ -260,6 +525,7 @@ struct file_list *send_file_list(int f,int recurse,int argc,char *argv[])
 
     // 目录且递归，argc = 1
     if (S_ISDIR(st.st_mode) && argc == 1) {
+      send_all(f,flist);
       if (chdir(fname) != 0) {
 	fprintf(stderr,"chdir %s : %s\n",fname,strerror(errno));
 	continue;
@@ -290,6 +556,7 @@ struct file_list *send_file_list(int f,int recurse,int argc,char *argv[])
 	exit(1);
       }
         // 更换工作目录
+      send_all(f,flist);
       if (chdir(dir) != 0) {
 	fprintf(stderr,"chdir %s : %s\n",dir,strerror(errno));
 	continue;
@@ -297,6 +564,7 @@ struct file_list *send_file_list(int f,int recurse,int argc,char *argv[])
       flist_dir = dir;
       send_file_name(f,flist,recurse,fname);
       flist_dir = NULL;
+      send_all(f,flist);
         // 恢复原来的工作目录
       if (chdir(dbuf) != 0) {
 	fprintf(stderr,"chdir %s : %s\n",dbuf,strerror(errno));
@@ -308,54 +576,69 @@ struct file_list *send_file_list(int f,int recurse,int argc,char *argv[])
     send_file_name(f,flist,recurse,fname);
   }
 
+  send_all(f,flist);
   write_int(f,0);
   write_flush(f);
-  return flist;
-}
 
+  if (getcwd(walk_home,MAXPATHLEN-1) == NULL) {
+    fprintf(stderr,"getwd : %s\n",strerror(errno));
+    exit(1);
+  }
+  walk_base = NULL;
 
+  /* the names were pushed in order, walk them in order */
+  for (i=0;i<walk_count/2;i++) {
+    w = walk[i];
+    walk[i] = walk[walk_count-1-i];
+    walk[walk_count-1-i] = w;
+  }
 
-struct file_list *recv_file_list(int f)
+  return flist;
+}
+
+/*
+  the generator has started on the last segment it was sent. Send it
+  the next one, or FLIST_END when the walk is over
+  */
+void send_flist_segment(int f,struct file_list *flist)
 {
-  int l;
-  struct file_list *flist;
-  int malloc_count=0;
+  if (walk_count == 0) {
+    stop_checksums();
+    file_sums_save();
+    write_int(f,FLIST_END);
+    return;
+  }
+
+  write_int(f,FLIST_SEGMENT);
+  segment_bytes = 0;
+  walk_dirs(f,flist);
+  write_int(f,0);
 
   if (verbose > 2)
-    fprintf(stderr,"recv_file_list starting\n");
+    fprintf(stderr,"file list segment of %d bytes, %d files so far\n",
+	    segment_bytes,flist->count);
+}
 
-  flist = (struct file_list *)malloc(sizeof(flist[0]));
-  if (!flist)
-    goto oom;
 
-  malloc_count=100;
-  flist->files = (struct file_struct *)malloc(sizeof(flist->files[0])*
-					      malloc_count);
-  if (!flist->files)
-    goto oom;
 
-  flist->count=0;
+/* read entries from f onto the end of flist, up to the 0 after them */
+static void recv_entries(int f,struct file_list *flist)
+{
+  int l;
 
   for (l=read_int(f); l; l=read_int(f)) {
     int i = flist->count;
 
-    if (i >= malloc_count) {
-      malloc_count += 100;
-      flist->files =(struct file_struct *)realloc(flist->files,
-						  sizeof(flist->files[0])*
-						  malloc_count);
-      if (!flist->files)
-	goto oom;
-    }
+    grow_flist(flist);
 
     flist->files[i].name = (char *)malloc(l+1);
     if (!flist->files[i].name) 
-      goto oom;
+      out_of_memory("recv_entries");
 
     read_buf(f,flist->files[i].name,l);
     flist->files[i].name[l] = 0;
-    flist->files[i].modtime = (time_t)read_int(f);
-    flist->files[i].length = (off_t)read_int(f);
+    flist->files[i].modtime = (time_t)read_longint(f);
+    flist->files[i].length = (off_t)read_longint(f);
     flist->files[i].mode = (mode_t)read_int(f);
     if (preserve_uid)
       flist->files[i].uid = (uid_t)read_int(f);
@@ -368,6 +651,8 @@ struct file_list *recv_file_list(int f)
     if (preserve_links && S_ISLNK(flist->files[i].mode)) {
       int l = read_int(f);
       flist->files[i].link = (char *)malloc(l+1);
+      if (!flist->files[i].link)
+	out_of_memory("recv_entries");
       read_buf(f,flist->files[i].link,l);
       flist->files[i].link[l] = 0;
     }
@@ -384,15 +669,40 @@ struct file_list *recv_file_list(int f)
     if (verbose > 2)
       fprintf(stderr,"recv_file_name(%s)\n",flist->files[i].name);
   }
+}
+
+/* the first segment of the file list */
+struct file_list *recv_file_list(int f)
+{
+  struct file_list *flist;
+
+  if (verbose > 2)
+    fprintf(stderr,"recv_file_list starting\n");
 
+  flist = new_flist();
+  recv_entries(f,flist);
 
   if (verbose > 2)
     fprintf(stderr,"received %d names\n",flist->count);
 
   return flist;
-
-oom:
-    out_of_memory("recv_file_list");
-    return NULL; /* not reached */
 }
 
+/*
+  a later segment, which follows FLIST_SEGMENT. The receiver passes
+  each one on to the generator through f_copy, -1 for none
+  */
+void recv_flist_segment(int f,struct file_list *flist,int f_copy)
+{
+  int i, start = flist->count;
+
+  recv_entries(f,flist);
+
+  if (f_copy != -1) {
+    write_int(f_copy,FLIST_SEGMENT);
+    for (i=start;i<flist->count;i++)
+      send_file_entry(&flist->files[i],f_copy);
+    write_int(f_copy,0);
+    write_flush(f_copy);
+  }
+}
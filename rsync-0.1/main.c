@@ -23,11 +23,19 @@ int verbose = 0;
 int always_checksum = 0;
 time_t starttime;
 off_t total_size = 0;
-int block_size=BLOCK_SIZE;
+int block_size=0; /* 0 means choose one per file */
+int num_threads=1;
+int cdc_chunking=0;
+int do_compression=0;
+char *sum_cache_dir=NULL; /* absolute, we chdir later */
+static char *sum_cache_arg=NULL;
+int read_mode=READ_MMAP;
 
 char *backup_suffix = BACKUP_SUFFIX;
 
 int make_backups = 0;
+int inplace = 0;
+int sparse_files = 0;
 int preserve_links = 0;
 int preserve_perms = 0;
 int preserve_devices = 0;
@@ -43,15 +51,19 @@ static int recurse = 0;
 
 static void report(int f)
 {
-  int in,out,tsize;
+  int64 in,out,tsize,lit=0,comp=0;
   time_t t = time(NULL);
   
   if (!verbose) return;
 
   if (server && sender) {
-    write_int(f,read_total());
-    write_int(f,write_total());
-    write_int(f,total_size);
+    write_longint(f,read_total());
+    write_longint(f,write_total());
+    write_longint(f,(int64)total_size);
+    if (do_compression) {
+      write_longint(f,literal_total());
+      write_longint(f,compressed_total());
+    }
     write_flush(f);
     return;
   }
@@ -59,17 +71,42 @@ static void report(int f)
   if (sender) {
     in = read_total();
     out = write_total();
-    tsize = (int)total_size;
+    tsize = total_size;
+    lit = literal_total();
+    comp = compressed_total();
   } else {
-    in = read_int(f);
-    out = read_int(f);
-    tsize = read_int(f);
+    in = read_longint(f);
+    out = read_longint(f);
+    tsize = read_longint(f);
+    if (do_compression) {
+      lit = read_longint(f);
+      comp = read_longint(f);
+    }
   }
 
-  printf("wrote %d bytes  read %d bytes  %g bytes/sec\n",
-	 out,in,(in+out)/(0.5 + (t-starttime)));        
-  printf("total size is %d  speedup is %g\n",
-	 tsize,(1.0*tsize)/(in+out));
+  printf("wrote %.0f bytes  read %.0f bytes  %g bytes/sec\n",
+	 (double)out,(double)in,(in+out)/(0.5 + (t-starttime)));        
+  printf("total size is %.0f  speedup is %g\n",
+	 (double)tsize,(1.0*tsize)/(in+out));
+  if (do_compression)
+    printf("literal data %.0f bytes compressed to %.0f bytes (%.2f:1)\n",
+	   (double)lit,(double)comp,comp?(1.0*lit)/comp:1.0);
+}
+
+/*
+  the exit code of a child, 1 if it was killed. With a remote
+  receiver this is how a file it couldn't get right shows up in the
+  client's exit code
+  */
+static int wait_process(int pid)
+{
+  int status = 0;
+
+  if (waitpid(pid,&status,0) != pid)
+    return 0;
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  return 1;
 }
 
 
@@ -81,6 +118,7 @@ int do_cmd(char *cmd,char *machine,char *user,char *path,int *f_in,int *f_out)
   char *tok,*p;
   char argstr[30]="-s";
   char bsize[30];
+  char nthreads[30];
 
   // 调用rsh,环境需安装rsh
   // cmd : rsh
@@ -145,10 +183,25 @@ int do_cmd(char *cmd,char *machine,char *user,char *path,int *f_in,int *f_out)
 
   args[argc++] = argstr;
 
-  if (block_size != BLOCK_SIZE) {
+  if (block_size) {
     sprintf(bsize,"-B%d",block_size);
     args[argc++] = bsize;
   }    
+
+  if (num_threads > 1) {
+    sprintf(nthreads,"-j%d",num_threads);
+    args[argc++] = nthreads;
+  }
+
+  if (sum_cache_arg) {
+    args[argc++] = "-k";
+    args[argc++] = sum_cache_arg;
+  }
+
+  if (read_mode == READ_PREAD) {
+    args[argc++] = "-M";
+    args[argc++] = "read";
+  }
   
   // 从最右侧起找/定位文件的目录
   // cmd : rsh -l root xintest2 rsync -slogDtpr /root/test1 /root/test1/xintest1_file_on_xintest2
@@ -230,8 +283,10 @@ void do_server_recv(int argc,char *argv[])
 		fprintf(stderr,"argc %d dir %d %s \n",argc,k,argv[k]);
 	}
 
-  int pid,i,status;
+  int pid, failed;
+  int redo_pipe[2], list_pipe[2];
   char *dir = NULL;
+  char *local_name = NULL;
   struct file_list *flist;
   char *fname=NULL;
   struct stat st;
@@ -282,40 +337,37 @@ void do_server_recv(int argc,char *argv[])
     exit(1);
   }
 
+  if (pipe(redo_pipe) != 0 || pipe(list_pipe) != 0) {
+    fprintf(stderr,"pipe : %s\n",strerror(errno));
+    exit(1);
+  }
+
   if ((pid=fork()) == 0) {
 	  // 父进程
+    close(redo_pipe[1]);
+    close(list_pipe[1]);
     if (verbose > 2)
       fprintf(stderr,"generator starting pid=%d count=%d\n",
 	      (int)getpid(),flist->count);
 
-    for (i = 0; i < flist->count; i++) {
-      if (S_ISDIR(flist->files[i].mode)) {
-	if (mkdir(flist->files[i].name,flist->files[i].mode) != 0 && 
-	    errno != EEXIST) {	 
-	  fprintf(stderr,"mkdir %s: %s\n",
-		  flist->files[i].name,strerror(errno));
-	  exit(1);
-	}
-	continue;
-      }
-      fname = flist->files[i].name;
-      if (flist->count == 1 &&
-	  argc > 0)
-	fname = argv[0];
-      recv_generator(fname,flist,i,STDOUT_FILENO);
-    }
-    write_int(STDOUT_FILENO,-1);
-    write_flush(STDOUT_FILENO);
+    /* a single file can be given another name */
+    if (flist->count == 1 && argc > 0 && !S_ISDIR(flist->files[0].mode))
+      local_name = argv[0];
+    generate_files(STDOUT_FILENO,flist,local_name,list_pipe[0]);
+    generate_redo(redo_pipe[0],flist,local_name,STDOUT_FILENO);
     if (verbose > 1)
-      fprintf(stderr,"generator wrote %d\n",write_total());
+      fprintf(stderr,"generator wrote %.0f\n",(double)write_total());
     exit(0);
   }
 
-  recv_files(STDIN_FILENO,flist,fname);
+  close(redo_pipe[0]);
+  close(list_pipe[0]);
+  failed = recv_files(STDIN_FILENO,flist,fname,redo_pipe[1],list_pipe[1]);
   if (verbose > 1)
-    fprintf(stderr,"receiver read %d\n",read_total());
-  waitpid(pid, &status, 0);
-  exit(status);
+    fprintf(stderr,"receiver read %.0f\n",(double)read_total());
+  if (wait_process(pid) || failed)
+    exit(1);
+  exit(0);
 }
 
 
@@ -331,6 +383,8 @@ void usage(void)
   fprintf(stderr,"-r       : recurse into directories\n");
   fprintf(stderr,"-b       : make backups (default ~ extension)\n");
   fprintf(stderr,"-u       : update only (don't overwrite newer files)\n");
+  fprintf(stderr,"-I       : update files in place, not through a temporary copy\n");
+  fprintf(stderr,"-H       : keep the holes in sparse files\n");
   fprintf(stderr,"-l       : preserve soft links\n");
   fprintf(stderr,"-p       : preserve permissions\n");
   fprintf(stderr,"-o       : preserve owner (root only)\n");
@@ -338,13 +392,20 @@ void usage(void)
   fprintf(stderr,"-D       : preserve devices (root only)\n");
   fprintf(stderr,"-t       : preserve times\n");  
   fprintf(stderr,"-e cmd   : specify rsh replacement\n");
+  fprintf(stderr,"-B size  : checksum blocking size (default about sqrt of file size)\n");
+  fprintf(stderr,"-j n     : use n threads for checksums and searches\n");
+  fprintf(stderr,"-C       : match content defined chunks, not fixed blocks\n");
+  fprintf(stderr,"-z       : compress literal data\n");
+  fprintf(stderr,"-k dir   : cache block signatures and -c checksums in dir\n");
+  fprintf(stderr,"-M mode  : read files with mmap (default) or read\n");
 }
 
 
 int main(int argc,char *argv[])
 {
-    int i, pid, status, pid2, status2;
-    int opt;
+    int pid, status, pid2, status2, failed;
+    int redo_pipe[2], list_pipe[2];
+    int opt, options;
     extern char *optarg;
     extern int optind;
     char *shell_cmd = NULL;
@@ -358,7 +419,7 @@ int main(int argc,char *argv[])
 
     starttime = time(NULL);
 
-    while ((opt=getopt(argc, argv, "oblpguDtcahvSsre:B:")) != EOF)
+    while ((opt=getopt(argc, argv, "oblpguDtcahvSsrCzIHe:B:j:k:M:")) != EOF)
       switch (opt) 
 	{
 	case 'h':
@@ -373,6 +434,14 @@ int main(int argc,char *argv[])
 	  update_only=1;
 	  break;
 
+	case 'I':
+	  inplace=1;
+	  break;
+
+	case 'H':
+	  sparse_files=1;
+	  break;
+
 #if SUPPORT_LINKS
 	case 'l':
 	  preserve_links=1;
@@ -453,6 +522,52 @@ int main(int argc,char *argv[])
 
 	case 'B':
 	  block_size = atoi(optarg);
+	  if (block_size <= 0) {
+	    fprintf(stderr,"invalid block size %s\n",optarg);
+	    exit(1);
+	  }
+	  break;
+
+	case 'C':
+	  cdc_chunking = 1;
+	  break;
+
+	case 'z':
+	  do_compression = 1;
+	  break;
+
+	case 'k':
+	  sum_cache_arg = optarg;
+	  sum_cache_dir = optarg;
+	  if (optarg[0] != '/') {
+	    char cwd[MAXPATHLEN];
+	    if (!getcwd(cwd,sizeof(cwd))) {
+	      fprintf(stderr,"getcwd : %s\n",strerror(errno));
+	      exit(1);
+	    }
+	    sum_cache_dir = (char *)malloc(strlen(cwd)+strlen(optarg)+2);
+	    if (!sum_cache_dir) out_of_memory("main");
+	    sprintf(sum_cache_dir,"%s/%s",cwd,optarg);
+	  }
+	  break;
+
+	case 'M':
+	  if (strcmp(optarg,"mmap") == 0) {
+	    read_mode = READ_MMAP;
+	  } else if (strcmp(optarg,"read") == 0) {
+	    read_mode = READ_PREAD;
+	  } else {
+	    fprintf(stderr,"invalid read mode %s\n",optarg);
+	    exit(1);
+	  }
+	  break;
+
+	case 'j':
+	  num_threads = atoi(optarg);
+	  if (num_threads <= 0) {
+	    fprintf(stderr,"invalid thread count %s\n",optarg);
+	    exit(1);
+	  }
 	  break;
 
 	default:
@@ -460,6 +575,11 @@ int main(int argc,char *argv[])
 	  exit(1);
 	}
 
+    if (inplace && make_backups) {
+      fprintf(stderr,"-I and -b can't be used together\n");
+      exit(1);
+    }
+
     while (optind--) {
       argc--;
       argv++;
@@ -481,7 +601,13 @@ int main(int argc,char *argv[])
 		version,PROTOCOL_VERSION);
 	exit(1);
       }
+      options = read_int(STDIN_FILENO) & PROTO_SUPPORTED;
+      cdc_chunking = (options & PROTO_CDC) != 0;
+      do_compression = (options & PROTO_COMPRESS) != 0;
+      inplace = (options & PROTO_INPLACE) != 0;
+      sparse_files = (options & PROTO_SPARSE) != 0;
       write_int(STDOUT_FILENO,PROTOCOL_VERSION);
+      write_int(STDOUT_FILENO,options);
       write_flush(STDOUT_FILENO);
 	
       if (sender)
@@ -537,8 +663,6 @@ int main(int argc,char *argv[])
 	      shell_path?shell_path:"");
     }
     
-    signal(SIGCHLD,SIG_IGN);
-
     if (!sender && argc != 1) {
       usage();
       exit(1);
@@ -547,7 +671,12 @@ int main(int argc,char *argv[])
 	// 调用rsh
     pid = do_cmd(shell_cmd,shell_machine,shell_user,shell_path,&f_in,&f_out);
 
+    options = cdc_chunking?PROTO_CDC:0;
+    if (do_compression) options |= PROTO_COMPRESS;
+    if (inplace) options |= PROTO_INPLACE;
+    if (sparse_files) options |= PROTO_SPARSE;
     write_int(f_out,PROTOCOL_VERSION);
+    write_int(f_out,options);
     write_flush(f_out);
     {
       int version = read_int(f_in);
@@ -555,6 +684,10 @@ int main(int argc,char *argv[])
 	fprintf(stderr,"protocol version mismatch\n");
 	exit(1);
       }	
+      if (read_int(f_in) != options) {
+	fprintf(stderr,"server refused protocol options 0x%x\n",options);
+	exit(1);
+      }
     }
 
     if (verbose > 3) 
@@ -568,7 +701,7 @@ int main(int argc,char *argv[])
       send_files(flist,f_out,f_in);
       if (verbose > 3)
 	fprintf(stderr,"waiting on %d\n",pid);
-      waitpid(pid, &status, 0);
+      status = wait_process(pid);
       report(-1);
       exit(status);
     }
@@ -598,32 +731,29 @@ int main(int argc,char *argv[])
       }
     }
 
+    if (pipe(redo_pipe) != 0 || pipe(list_pipe) != 0) {
+      fprintf(stderr,"pipe : %s\n",strerror(errno));
+      exit(1);
+    }
+
     if ((pid2=fork()) == 0) {
-      for (i = 0; i < flist->count; i++) {
-	if (S_ISDIR(flist->files[i].mode)) {
-	  if (mkdir(flist->files[i].name,flist->files[i].mode) != 0 &&
-	      errno != EEXIST) {
-	    fprintf(stderr,"mkdir %s : %s\n",
-		    flist->files[i].name,strerror(errno));
-	  }
-	  continue;
-	}
-	recv_generator(local_name?local_name:flist->files[i].name,
-		       flist,i,f_out);
-      }
-      write_int(f_out,-1);
-      write_flush(f_out);
+      close(redo_pipe[1]);
+      close(list_pipe[1]);
+      generate_files(f_out,flist,local_name,list_pipe[0]);
+      generate_redo(redo_pipe[0],flist,local_name,f_out);
       if (verbose > 1)
-	fprintf(stderr,"generator wrote %d\n",write_total());
+	fprintf(stderr,"generator wrote %.0f\n",(double)write_total());
       exit(0);
     }
 
-    recv_files(f_in,flist,local_name);
+    close(redo_pipe[0]);
+    close(list_pipe[0]);
+    failed = recv_files(f_in,flist,local_name,redo_pipe[1],list_pipe[1]);
     report(f_in);
     if (verbose > 1)
-      fprintf(stderr,"receiver read %d\n",read_total());
-    waitpid(pid, &status, 0);
-    waitpid(pid2, &status2, 0);
+      fprintf(stderr,"receiver read %.0f\n",(double)read_total());
+    status = wait_process(pid);
+    status2 = wait_process(pid2);
 
-    return status | status2;
+    return status | status2 | (failed ? 1 : 0);
 }
@@ -20,159 +20,465 @@
 #include "rsync.h"
 
 extern int verbose;
-
-typedef unsigned short tag;
-
-#define TABLESIZE (1<<16)
-#define NULL_TAG ((tag)-1)
+extern int num_threads;
+extern int cdc_chunking;
+extern int inplace;
+extern int sparse_files;
 
 static int false_alarms;
 static int tag_hits;
 static int matches;
+static int next_hits;
 
+/* the blocks are found through an open addressing hash table keyed
+   on the whole of sum1, with at least twice as many slots as blocks
+   so the probe sequences stay short. Empty slots have i == -1 */
 struct target {
-  tag t;
+  uint32 sum1;
   int i;
 };
 
 static struct target *targets=NULL;
+static int table_shift;
+static uint32 table_mask;
 
-static tag tag_table[TABLESIZE];
-
-#define gettag(sum) (((sum)>>16) + ((sum)&0xFFFF))
+/* one bit per hash value, checked before the table is probed. It is
+   at least 8 times the number of blocks so few offsets get past it,
+   and small enough to stay in cache for all but the largest files */
+static uint32 *hash_bits=NULL;
+static int bits_shift;
 
-static int compare_targets(struct target *t1,struct target *t2)
-{
-  return(t1->t - t2->t);
-}
+#define hash_sum(sum) ((uint32)(sum) * 0x9e3779b1)
+#define hash_present(h) \
+  (hash_bits[(h)>>bits_shift>>5] & (1<<(((h)>>bits_shift)&31)))
 
 static void build_hash_table(struct sum_struct *s)
 {
-  int i;
+  int i,bits;
+  uint32 h,j;
 
-  targets = (struct target *)malloc(sizeof(targets[0])*s->count);
+  for (bits=1; (1<<bits) < 2*s->count; bits++) ;
+  table_shift = 32 - bits;
+  table_mask = (1<<bits) - 1;
+  targets = (struct target *)malloc(sizeof(targets[0])<<bits);
   if (!targets) out_of_memory("build_hash_table");
+  for (i=0;i<(1<<bits);i++)
+    targets[i].i = -1;
+
+  for (bits=16; (1<<bits) < 8*s->count; bits++) ;
+  bits_shift = 32 - bits;
+  hash_bits = (uint32 *)malloc((1<<bits)/8);
+  if (!hash_bits) out_of_memory("build_hash_table");
+  bzero(hash_bits,(1<<bits)/8);
 
+  /* blocks are added in order so a probe meets the lowest numbered
+     of several blocks with the same sum1 first */
   for (i=0;i<s->count;i++) {
-    targets[i].i = i;
-    targets[i].t = gettag(s->sums[i].sum1);
-    fprintf(stderr, " %d -> %u -> %d\n", i, targets[i].t, targets[i].i);
+    h = hash_sum(s->sums[i].sum1);
+    hash_bits[h>>bits_shift>>5] |= 1<<((h>>bits_shift)&31);
+    for (j=h>>table_shift; targets[j].i != -1; j=(j+1)&table_mask) ;
+    targets[j].sum1 = s->sums[i].sum1;
+    targets[j].i = i;
   }
+}
 
-  // 从大到小排序
-  qsort(targets,s->count,sizeof(targets[0]),(int (*)())compare_targets);
 
-  for (i=0;i<s->count;i++) {
-    fprintf(stderr, " %d -> %u -> %d\n", i, targets[i].t, targets[i].i);
+
+static struct map_struct *map;
+static off_t last_match;
+static off_t released;		/* data before this has been let go */
+
+/* with -H the holes in the file, in order. The search skips over them
+   and they are sent as holes, left out of the whole file checksum */
+struct hole {
+  off_t start, end;
+};
+
+static struct hole *holes = NULL;
+static int nholes, holes_size;
+static int literal_hole;	/* the first hole not before last_match */
+
+static void find_holes(int fd,off_t len)
+{
+  off_t data, hole = 0;
+
+  nholes = 0;
+  while (hole < len) {
+    data = lseek(fd,hole,SEEK_DATA);
+    if (data == -1) {
+      if (errno != ENXIO) break;
+      data = len;
+    }
+    data = MIN(data,len);
+    if (data > hole) {
+      if (nholes == holes_size) {
+	holes_size = holes_size ? holes_size*2 : 64;
+	holes = (struct hole *)realloc(holes,sizeof(holes[0])*holes_size);
+	if (!holes) out_of_memory("find_holes");
+      }
+      holes[nholes].start = hole;
+      holes[nholes].end = data;
+      nholes++;
+    }
+    if (data == len) break;
+    hole = lseek(fd,data,SEEK_HOLE);
+    if (hole == -1) break;
   }
-  for (i=0;i<TABLESIZE;i++)
-    tag_table[i] = NULL_TAG;
 
-  // vector< pair< tag, i > > targets
-  // tag_table 类似bitmap， 第 x 个，存tag 为x 的下标i
-  // 此函数如果用复杂一点的数据结构，就是 map<tag, pair<tag, i> > , 更简洁就是 map<tag, i>
-  // 如果存在相同的 targets[i].t 那么这里记录下来的是最小的 i 
-  // 所以后面在查的时候，命中了，还得从i开始循环遍历整个 targets 才能把所有可能的 targets[i].t 找到
-  for (i=s->count-1;i>=0;i--) {    
-    tag_table[targets[i].t] = i;
+  if (verbose > 2 && nholes > 0)
+    fprintf(stderr,"%d holes\n",nholes);
+}
+
+/* the first hole that ends after offset */
+static int first_hole(off_t offset)
+{
+  int lo = 0, hi = nholes, mid;
+
+  while (lo < hi) {
+    mid = (lo+hi)/2;
+    if (holes[mid].end <= offset)
+      lo = mid+1;
+    else
+      hi = mid;
   }
+  return lo;
 }
 
+/* the end of the hole offset is in, or offset if it isn't in one. *h
+   is moved on to the first hole that ends after offset */
+static off_t hole_end(int *h,off_t offset)
+{
+  while (*h < nholes && holes[*h].end <= offset)
+    (*h)++;
+  if (*h < nholes && offset >= holes[*h].start)
+    return holes[*h].end;
+  return offset;
+}
 
+/* let go of the data that has been sent, a window at a time. The
+   window before last_match is kept, the next literal run's dictionary
+   comes from there */
+static void release_behind(void)
+{
+  if (last_match - released >= 2*MAP_WINDOW) {
+    map_release(map,released,last_match-MAP_WINDOW-released);
+    released = last_match-MAP_WINDOW;
+  }
+}
 
-static off_t last_match;
+/*
+  send the n bytes of literal data at last_match followed by token i,
+  and add them to the whole file checksum. The holes in it go as holes
+  */
+static void send_literal(int f,int i,char *buf,int n)
+{
+  off_t offset = last_match, end = last_match+n, start;
+
+  for (; literal_hole < nholes && holes[literal_hole].start < end;
+       literal_hole++) {
+    if (holes[literal_hole].end <= offset)
+      continue;
+    start = MAX(holes[literal_hole].start,offset);
+    if (start > offset) {
+      send_token(f,-2,buf,offset,start-offset);
+      sum_update(buf+offset,start-offset);
+    }
+    offset = MIN(holes[literal_hole].end,end);
+    send_hole(f,offset-start);
+    if (offset == end)
+      break;
+  }
+
+  send_token(f,i,buf,offset,end-offset);
+  if (end > offset)
+    sum_update(buf+offset,end-offset);
+}
+
+/*
+  send the first MAP_WINDOW bytes of the literal data since the last
+  match, when there is more than that. The search does this as it
+  goes, so a file with little in common with the basis file doesn't
+  have to be resident before any of it can be sent
+  */
+static void send_window(int f,char *buf)
+{
+  map_ptr(map,last_match,MAP_WINDOW);
+  send_literal(f,-2,buf,MAP_WINDOW);
+  last_match += MAP_WINDOW;
+  release_behind();
+}
 
 
 // 直到找到一个match
 // 把上一次match的位置 到这一次match的位置中间的所有buf发过去（也就是不match的部分发过去）
-static void matched(int f,struct sum_struct *s,char *buf,off_t len,int offset,int i)
+static void matched(int f,struct sum_struct *s,char *buf,off_t len,off_t offset,int i)
 {
-  int n = offset - last_match;
-  
+  int n;
+
   if (verbose > 2)
     if (i != -1)
-      fprintf(stderr,"match at %d last_match=%d j=%d len=%d n=%d\n",
-	      (int)offset,(int)last_match,i,(int)s->sums[i].len,n);
+      fprintf(stderr,"match at %.0f last_match=%.0f j=%d len=%d n=%.0f\n",
+	      (double)offset,(double)last_match,i,(int)s->sums[i].len,
+	      (double)(offset-last_match));
+
+  while (offset - last_match > MAP_WINDOW)
+    send_window(f,buf);
+  n = offset - last_match;
+  map_ptr(map,last_match,n + (i != -1 ? s->sums[i].len : 0));
+
+  // 可能是0(有一方为空，剩余数据发送)， -1 第一块数据就相同, -2 依次类推
+  send_literal(f,i,buf,n);
+  if (i != -1) {
+    sum_update(buf+offset,s->sums[i].len);
+    last_match = offset + s->sums[i].len;
+  }
+  release_behind();
+}
+
+
+/*
+  a search through part of the file. The matches are either sent on
+  with matched() as they are found or, for the worker threads,
+  recorded so they can be stitched into the token stream later
+  */
+struct match_rec {
+  off_t offset;
+  int i;
+};
+
+struct search {
+  off_t start, end;		/* offsets searched are [start,end) */
+  off_t stop;			/* where it stopped */
+  int next;			/* and the block hint there */
+  int count, size;		/* matches recorded in m */
+  struct match_rec *m;
+  int done;			/* a worker has finished with it */
+  int false_alarms, tag_hits, matches, next_hits;
+};
 
-  if (n > 0) {
-    write_int(f,n);
-    write_buf(f,buf+last_match,n);
+static void add_match(struct search *r,off_t offset,int i)
+{
+  if (r->count == r->size) {
+    r->size = r->size ? r->size*2 : 256;
+    r->m = (struct match_rec *)realloc(r->m,sizeof(r->m[0])*r->size);
+    if (!r->m) out_of_memory("add_match");
   }
-  write_int(f,-(i+1)); // 可能是0(有一方为空，剩余数据发送)， -1 第一块数据就相同, -2 依次类推
-  if (i != -1)
-    last_match = offset + s->sums[i].len;
-  if (n > 0)
-    write_flush(f);
+  r->m[r->count].offset = offset;
+  r->m[r->count].i = i;
+  r->count++;
 }
 
+/*
+  can block i be used at offset? With -I the receiver builds the file
+  over the basis file from the start, so by the time it gets to offset
+  everything before that has been written over
+  */
+static int usable(struct sum_struct *s,int i,off_t offset)
+{
+  return !inplace || s->sums[i].offset >= offset;
+}
 
-static void hash_search(int f,struct sum_struct *s,char *buf,off_t len)
+static void add_stats(struct search *r)
 {
-    // 对比本地文件 buf 和 对端传递过来的 checksums
-  int offset,j,k;
-  int end;
+  false_alarms += r->false_alarms;
+  tag_hits += r->tag_hits;
+  next_hits += r->next_hits;
+}
+
+/*
+  would a search that has got to offset, expecting block next there,
+  carry on just as the search r did? It would if r looked at that
+  offset and found nothing (no block can match there, whatever the
+  hint) or if r found a match starting there with the same hint. *k
+  follows the first of r's matches at or after offset
+  */
+static int in_step(struct sum_struct *s,struct search *r,int *k,
+		   off_t offset,int next)
+{
+  struct match_rec *m;
+  off_t e = r->start;
+
+  if (offset < r->start || offset >= r->end)
+    return 0;
+
+  while (*k < r->count && r->m[*k].offset < offset)
+    (*k)++;
+
+  if (*k > 0) {
+    m = &r->m[*k-1];
+    e = m->offset + s->sums[m->i].len;
+  }
+
+  if (*k < r->count && r->m[*k].offset == offset)
+    return next == ((*k > 0 && e == offset) ? r->m[*k-1].i + 1 : -1);
+
+  return offset >= e;
+}
+
+
+/*
+  search buf from offset, where block next is expected (or -1 for
+  none), until the offset reaches r->end. With f != -1 the matches go
+  straight to matched(), otherwise they are added to r. If sync is
+  given the search ends as soon as it falls into step with that
+  earlier search of the same region, and the index of the first of
+  its matches still to be used is returned. Otherwise returns -1
+  */
+static int search(int f,struct sum_struct *s,char *buf,off_t len,
+		  struct search *r,off_t offset,int next,struct search *sync)
+{
+  int i,j,k,b,x,ks=0,h=first_hole(offset);
+  off_t end = r->end, after;
+  off_t avail, limit = MIN(len,end+2*s->n+ROLL_BATCH);
+  int done_csum2;
   char sum2[SUM_LENGTH];
-  uint32 s1, s2, sum;
+  uint32 s1, s2, sum, hs;
+  uint32 s1v[ROLL_BATCH+1], s2v[ROLL_BATCH+1];
 
-  if (verbose > 2)
-    fprintf(stderr,"hash search b=%d len=%d\n",s->n,(int)len);
+  /* the file is read in a window at a time as the search gets to it,
+     a match can look up to two blocks past the offset */
+  avail = offset + MIN(limit-offset,MAP_WINDOW);
+  map_ptr(map,offset,avail-offset);
 
-  k = MIN(len, s->n);
-  sum = get_checksum1(buf, k);
+  k = MIN(len-offset, s->n);
+  sum = get_checksum1(buf+offset, k);
   s1 = sum;
   s2 = sum >> 16;
   if (verbose > 3)
     fprintf(stderr, "sum=%.8x k=%d\n", sum, k);
 
-  offset = 0;
-
-  end = len + 1 - s->sums[s->count-1].len;
-
-  if (verbose > 3)
-    fprintf(stderr,"hash search s->n=%d len=%d count=%d\n",
-	    s->n,(int)len,s->count);
+  b = ROLL_BATCH;
 
   // 对于本地的buf，每次移动一个bytes，对比当前chunk是否在对端的checksums之中，
   // 在对端的checksums中，说明对端该数据块没有发生变化，此时发送直到找到match时的所有不match的数据过去
   do {
-    tag t = (s1 + s2) & 0xffff;		/* gettag(sum) */
-    j = tag_table[t];
-    if (verbose > 4)
-      fprintf(stderr,"offset=%d sum=%08x\n",
-	      offset,sum);
+    if (sync && in_step(s,sync,&ks,offset,next)) {
+      r->stop = offset;
+      r->next = next;
+      return ks;
+    }
+
+    /* there is nothing to find in a hole, the search starts again
+       after it */
+    after = hole_end(&h,offset);
+    if (after > offset) {
+      offset = after;
+      if (offset >= end)
+	break;
+      avail = offset + MIN(limit-offset,MAP_WINDOW);
+      map_ptr(map,offset,avail-offset);
+      k = MIN(len-offset, s->n);
+      sum = get_checksum1(buf+offset, k);
+      s1 = sum;
+      s2 = sum >> 16;
+      b = ROLL_BATCH;
+      next = -1;
+    }
+
+    /* the literal data so far is sent once there is a window of it,
+       just as matched() would send it when the next match turned up */
+    if (f != -1 && offset - last_match > MAP_WINDOW)
+      send_window(f,buf);
+
+    if (avail < limit && offset + 2*s->n + ROLL_BATCH >= avail) {
+      avail = offset + MIN(limit-offset,MAP_WINDOW);
+      map_ptr(map,offset,avail-offset);
+    }
+
+    /* while the window is full length, roll ROLL_BATCH offsets
+       ahead in one go and skip straight over the offsets whose sum
+       isn't in the table. Only offsets that may be in it go through the
+       byte at a time code below */
+    if (b == ROLL_BATCH && k == s->n && verbose < 4 &&
+	offset + ROLL_BATCH <= end && offset + k + ROLL_BATCH <= len) {
+      s1v[0] = s1;
+      s2v[0] = s2;
+      roll_checksum1(buf+offset,k,s1v,s2v);
+      b = 0;
+    }
 
-    if (j != NULL_TAG) {
-      int done_csum2 = 0;
+    if (b < ROLL_BATCH) {
+      for (x=b; x<ROLL_BATCH; x++)
+	if (hash_present(hash_sum((s1v[x] & 0xffff) + (s2v[x] << 16))))
+	  break;
+      if (x > b)
+	next = -1;
+      offset += x - b;
+      s1 = s1v[x];
+      s2 = s2v[x];
+      if (x == ROLL_BATCH) {
+	b = ROLL_BATCH;
+	offset--;
+	continue;
+      }
+      b = x+1;
+    }
 
-      sum = (s1 & 0xffff) + (s2 << 16);
-      tag_hits++;
-      do {
-	int i = targets[j].i;
+    sum = (s1 & 0xffff) + (s2 << 16);
+    if (verbose > 4)
+      fprintf(stderr,"offset=%.0f sum=%08x\n",
+	      (double)offset,sum);
+
+    i = -1;
+    done_csum2 = 0;
+
+    /* straight after a match the block that followed it in the basis
+       file is by far the likeliest, so try it before the table */
+    if (next != -1 && next < s->count && usable(s,next,offset) &&
+	s->sums[next].len == k && sum == s->sums[next].sum1) {
+      get_checksum2(buf+offset,k,sum2);
+      done_csum2 = 1;
+      if (memcmp(sum2,s->sums[next].sum2,s->s2length) == 0) {
+	i = next;
+	r->next_hits++;
+      } else {
+	r->false_alarms++;
+      }
+    }
+    next = -1;
 
-	if (sum == s->sums[i].sum1) {
+    hs = hash_sum(sum);
+    if (i == -1 && hash_present(hs)) {
+      r->tag_hits++;
+      for (j=hs>>table_shift; targets[j].i != -1; j=(j+1)&table_mask) {
+	if (sum == targets[j].sum1 && usable(s,targets[j].i,offset)) {
 	  if (verbose > 3)
-	    fprintf(stderr,"potential match at %d target=%d %d sum=%08x\n",
-		    offset,j,i,sum);
+	    fprintf(stderr,"potential match at %.0f target=%d %d sum=%08x\n",
+		    (double)offset,j,targets[j].i,sum);
 
 	  if (!done_csum2) {
 	    get_checksum2(buf+offset,MIN(s->n,len-offset),sum2);
 	    done_csum2 = 1;
 	  }
-	  if (memcmp(sum2,s->sums[i].sum2,SUM_LENGTH) == 0) {
-	    matched(f,s,buf,len,offset,i);
-	    offset += s->sums[i].len - 1;
-	    k = MIN((len-offset), s->n);
-	    sum = get_checksum1(buf+offset, k);
-	    s1 = sum;
-	    s2 = sum >> 16;
-	    ++matches;
-	    break;
-	  } else {
-	    false_alarms++;
+	  if (memcmp(sum2,s->sums[targets[j].i].sum2,s->s2length) == 0) {
+	    /* with -I a block already in place is best, it costs
+	       no writing at all */
+	    if (i == -1)
+	      i = targets[j].i;
+	    if (!inplace || s->sums[targets[j].i].offset == offset) {
+	      i = targets[j].i;
+	      break;
+	    }
+	    continue;
 	  }
+	  r->false_alarms++;
 	}
-	j++;
-      } while (j<s->count && targets[j].t == t);
+      }
+    }
+
+    if (i != -1) {
+      if (f != -1)
+	matched(f,s,buf,len,offset,i);
+      else
+	add_match(r,offset,i);
+      b = ROLL_BATCH;
+      next = i+1;
+      offset += s->sums[i].len - 1;
+      k = MIN((len-offset), s->n);
+      sum = get_checksum1(buf+offset, k);
+      s1 = sum;
+      s2 = sum >> 16;
+      r->matches++;
     }
 
     /* Trim off the first byte from the checksum */
@@ -200,17 +506,259 @@ static void hash_search(int f,struct sum_struct *s,char *buf,off_t len)
 	      k, (int)offset, buf[offset], buf[offset+k]);
   } while (++offset < end);
 
+  r->stop = offset;
+  r->next = next;
+  return -1;
+}
+
+
+/* the regions being searched by the worker threads */
+static struct search *regions;
+static int nregions, next_region, regions_sent;
+static struct sum_struct *search_s;
+static char *search_buf;
+static off_t search_len;
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t search_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+  a worker takes the regions in order, but keeps no more than
+  SEARCH_AHEAD regions per thread ahead of those already sent
+  */
+static void *search_worker(void *arg)
+{
+  struct search *r;
+  int t;
+
+  while (1) {
+    pthread_mutex_lock(&search_lock);
+    while (next_region < nregions &&
+	   next_region >= regions_sent + SEARCH_AHEAD*num_threads)
+      pthread_cond_wait(&search_cond,&search_lock);
+    t = next_region++;
+    pthread_mutex_unlock(&search_lock);
+
+    if (t >= nregions)
+      break;
+
+    r = &regions[t];
+    search(-1,search_s,search_buf,search_len,r,r->start,-1,NULL);
+
+    pthread_mutex_lock(&search_lock);
+    r->done = 1;
+    pthread_cond_broadcast(&search_cond);
+    pthread_mutex_unlock(&search_lock);
+  }
+  return NULL;
+}
+
+
+/*
+  search the file in regions of size bytes on num_threads threads.
+  Each region is searched as though nothing came before it. As the
+  regions finish they are stitched together in order: the search is
+  redone serially from wherever the previous region left off until it
+  falls into step with the worker's search, and from there the
+  worker's matches are used. The tokens come out exactly as they would
+  from a single search of the whole file.
+
+  returns 0 if no threads could be started
+  */
+static int threaded_search(int f,struct sum_struct *s,char *buf,off_t len,
+			   off_t end,int size)
+{
+  pthread_t *tids;
+  struct search tmp, *r;
+  int t,n,j,k;
+  off_t offset = 0;
+  int next = -1;
+
+  nregions = (end + size - 1) / size;
+  regions = (struct search *)malloc(sizeof(regions[0])*nregions);
+  tids = (pthread_t *)malloc(sizeof(tids[0])*num_threads);
+  if (!regions || !tids) out_of_memory("threaded_search");
+  bzero(regions,sizeof(regions[0])*nregions);
+
+  for (t=0;t<nregions;t++) {
+    regions[t].start = (off_t)t*size;
+    regions[t].end = MIN(end,(off_t)(t+1)*size);
+  }
+  next_region = regions_sent = 0;
+  search_s = s;
+  search_buf = buf;
+  search_len = len;
+
+  checksum_init();
+
+  for (n=0;n<num_threads;n++)
+    if (pthread_create(&tids[n],NULL,search_worker,NULL) != 0)
+      break;
+
+  if (n == 0) {
+    free(tids);
+    free(regions);
+    return 0;
+  }
+
+  if (verbose > 2)
+    fprintf(stderr,"searching %d regions on %d threads\n",nregions,n);
+
+  for (t=0;t<nregions;t++) {
+    r = &regions[t];
+
+    pthread_mutex_lock(&search_lock);
+    while (!r->done)
+      pthread_cond_wait(&search_cond,&search_lock);
+    pthread_mutex_unlock(&search_lock);
+
+    if (offset < r->end) {
+      bzero(&tmp,sizeof(tmp));
+      tmp.start = offset;
+      tmp.end = r->end;
+      k = search(f,s,buf,len,&tmp,offset,next,r);
+      if (k != -1) {
+	for (j=k;j<r->count;j++)
+	  matched(f,s,buf,len,r->m[j].offset,r->m[j].i);
+	matches += r->count - k;
+	offset = r->stop;
+	next = r->next;
+      } else {
+	offset = tmp.stop;
+	next = tmp.next;
+      }
+      matches += tmp.matches;
+      add_stats(&tmp);
+    }
+    add_stats(r);
+    if (r->m) free(r->m);
+
+    pthread_mutex_lock(&search_lock);
+    regions_sent = t+1;
+    pthread_cond_broadcast(&search_cond);
+    pthread_mutex_unlock(&search_lock);
+  }
+
+  while (n--)
+    pthread_join(tids[n],NULL);
+
+  free(tids);
+  free(regions);
+  return 1;
+}
+
+
+static void hash_search(int f,struct sum_struct *s,char *buf,off_t len)
+{
+    // 对比本地文件 buf 和 对端传递过来的 checksums
+  struct search r;
+  off_t end;
+  int size;
+
+  if (verbose > 2)
+    fprintf(stderr,"hash search b=%d len=%d\n",s->n,(int)len);
+
+  end = len + 1 - s->sums[s->count-1].len;
+  size = MAX(SEARCH_REGION,16*s->n);
+
+  if (verbose > 3)
+    fprintf(stderr,"hash search s->n=%d len=%d count=%d\n",
+	    s->n,(int)len,s->count);
+
+  if (num_threads < 2 || end < 2*size ||
+      !threaded_search(f,s,buf,len,end,size)) {
+    bzero(&r,sizeof(r));
+    r.end = end;
+    search(f,s,buf,len,&r,0,-1,NULL);
+    matches += r.matches;
+    add_stats(&r);
+  }
+
   // 最后有剩余部分的话，就发送过去
   matched(f,s,buf,len,len,-1);
 }
 
 
-void match_sums(int f,struct sum_struct *s,char *buf,off_t len)
+/*
+  with content defined chunks there is no need to look at every
+  offset: buf is cut up the same way as the basis file was and each
+  chunk is looked up once
+  */
+static void cdc_search(int f,struct sum_struct *s,char *buf,off_t len)
+{
+  off_t offset, after, avail = 0;
+  int i,j,k,hi=0;
+  int done_csum2;
+  char sum2[SUM_LENGTH];
+  uint32 sum, h;
+
+  if (verbose > 2)
+    fprintf(stderr,"cdc search n=%d len=%d\n",s->n,(int)len);
+
+  for (offset=0; offset<len; offset+=k) {
+    after = hole_end(&hi,offset);
+    if (after > offset) {
+      offset = after;
+      k = 0;
+      continue;
+    }
+    if (offset - last_match > MAP_WINDOW)
+      send_window(f,buf);
+    if (avail < len && offset + 4*s->n > avail) {
+      avail = offset + MIN(len-offset,MAP_WINDOW);
+      map_ptr(map,offset,avail-offset);
+    }
+    k = cdc_next(buf+offset,MIN(len-offset,4*s->n),s->n);
+    sum = get_checksum1(buf+offset,k);
+    h = hash_sum(sum);
+    if (!hash_present(h))
+      continue;
+
+    tag_hits++;
+    done_csum2 = 0;
+    for (j=h>>table_shift; targets[j].i != -1; j=(j+1)&table_mask) {
+      i = targets[j].i;
+      if (sum != targets[j].sum1 || s->sums[i].len != k ||
+	  !usable(s,i,offset))
+	continue;
+
+      if (!done_csum2) {
+	get_checksum2(buf+offset,k,sum2);
+	done_csum2 = 1;
+      }
+      if (memcmp(sum2,s->sums[i].sum2,s->s2length) == 0) {
+	matched(f,s,buf,len,offset,i);
+	matches++;
+	break;
+      }
+      false_alarms++;
+    }
+  }
+
+  matched(f,s,buf,len,len,-1);
+}
+
+
+/*
+  the tokens for the mapped file are followed by the checksum of the
+  whole of it, which the receiver checks the file it built against
+  */
+void match_sums(int f,struct sum_struct *s,struct map_struct *m,off_t len)
 {
     // 对比本地文件 buf 和 对端传递过来的 checksums
+  char file_sum[SUM_LENGTH];
+  char *buf = m->p;
+
+  map = m;
   last_match = 0;
+  released = 0;
+  nholes = literal_hole = 0;
+  if (sparse_files && len > 0)
+    find_holes(m->fd,len);
   false_alarms = 0;
   tag_hits = 0;
+  next_hits = 0;
+
+  sum_init();
 
   if (len > 0 && s->count>0) {
     build_hash_table(s);
@@ -218,7 +766,10 @@ void match_sums(int f,struct sum_struct *s,char *buf,off_t len)
     if (verbose > 2) 
       fprintf(stderr,"built hash table\n");
 
-    hash_search(f,s,buf,len);
+    if (cdc_chunking)
+      cdc_search(f,s,buf,len);
+    else
+      hash_search(f,s,buf,len);
 
     if (verbose > 2) 
       fprintf(stderr,"done hash search\n");
@@ -229,12 +780,19 @@ void match_sums(int f,struct sum_struct *s,char *buf,off_t len)
     matched(f,s,buf,len,len,-1);
   }
 
+  sum_end(file_sum);
+  write_buf(f,file_sum,SUM_LENGTH);
+
   if (targets) {
     free(targets);
     targets=NULL;
   }
+  if (hash_bits) {
+    free(hash_bits);
+    hash_bits=NULL;
+  }
 
   if (verbose > 2)
-    fprintf(stderr, "false_alarms=%d tag_hits=%d matches=%d\n",
-	    false_alarms, tag_hits, matches);
+    fprintf(stderr, "false_alarms=%d tag_hits=%d matches=%d next_hits=%d\n",
+	    false_alarms, tag_hits, matches, next_hits);
 }
@@ -1,8 +1,13 @@
 /*
    This code is from rfc1186. 
 
-   It has been modified to use the SIVAL() macro to make it
+   It has been modified to use the IVAL() macro to make it
    byte order and length independent, so we don't need the LOWBYTEFIRST define
+
+   MDblock() reads the 16 input words straight out of the caller's
+   buffer rather than byte swapping them in place, so full blocks can
+   be hashed where they lie (aligned or not) without being copied
+   first.
 */
 
  /*
@@ -69,17 +74,17 @@
 #define hs4 15
 
  /* Compile-time macro declarations for MD4.
- ** Note: The "rot" operator uses the variable "tmp".
- ** It assumes tmp is declared as unsigned int, so that the >>
- ** operator will shift in zeros rather than extending the sign bit.
+ ** f and g are written so they need one less operation than the
+ ** textbook forms, and rot is a plain rotate that compilers turn
+ ** into a single instruction.
  */
-#define f(X,Y,Z)             ((X&Y) | ((~X)&Z))
-#define g(X,Y,Z)             ((X&Y) | (X&Z) | (Y&Z))
-#define h(X,Y,Z)             (X^Y^Z)
-#define rot(X,S)             (tmp=X,(tmp<<S) | (tmp>>(32-S)))
-#define ff(A,B,C,D,i,s)      A = rot((A + f(B,C,D) + X[i]),s)
-#define gg(A,B,C,D,i,s)      A = rot((A + g(B,C,D) + X[i] + C2),s)
-#define hh(A,B,C,D,i,s)      A = rot((A + h(B,C,D) + X[i] + C3),s)
+#define f(X,Y,Z)             ((Z) ^ ((X) & ((Y) ^ (Z))))
+#define g(X,Y,Z)             (((X) & (Y)) | ((Z) & ((X) | (Y))))
+#define h(X,Y,Z)             ((X) ^ (Y) ^ (Z))
+#define rot(X,S)             (((X)<<(S)) | ((X)>>(32-(S))))
+#define ff(A,B,C,D,i,s)      A += f(B,C,D) + X##i; A = rot(A,s)
+#define gg(A,B,C,D,i,s)      A += g(B,C,D) + X##i + C2; A = rot(A,s)
+#define hh(A,B,C,D,i,s)      A += h(B,C,D) + X##i + C3; A = rot(A,s)
 
  /* MDbegin(MDp)
  ** Initialize message digest buffer MDp.
@@ -97,35 +102,24 @@
    MDp->done = 0;
  }
 
- /* MDreverse(X)
- ** Reverse the byte-ordering of every int in X.
- ** Assumes X is an array of 16 ints.
- ** The macro revx reverses the byte-ordering of the next word of X.
- */
- void MDreverse(X)
- unsigned int32 *X;
- { register unsigned int32 t;
-   register unsigned int i;
-
-   for(i = 0; i < 16; i++) {
-	  t = X[i];
-	  SIVAL(X,i*4,t);
-	}
- }
-
  /* MDblock(MDp,X)
- ** Update message digest buffer MDp->buffer using 16-word data block X.
- ** Assumes all 16 words of X are full of data.
+ ** Update message digest buffer MDp->buffer using the 64 byte data
+ ** block at X. The words are loaded little-endian with IVAL(), X
+ ** is not modified and need not be aligned.
  ** Does not update MDp->count.
  ** This routine is not user-callable.
  */
  static void
  MDblock(MDp,X)
  MDptr MDp;
- unsigned int32 *X;
+ unsigned char *X;
  {
-   register unsigned int32 tmp, A, B, C, D;
-   MDreverse(X);
+   register unsigned int32 A, B, C, D;
+   unsigned int32 X0 = IVAL(X,0), X1 = IVAL(X,4), X2 = IVAL(X,8),
+     X3 = IVAL(X,12), X4 = IVAL(X,16), X5 = IVAL(X,20), X6 = IVAL(X,24),
+     X7 = IVAL(X,28), X8 = IVAL(X,32), X9 = IVAL(X,36), X10 = IVAL(X,40),
+     X11 = IVAL(X,44), X12 = IVAL(X,48), X13 = IVAL(X,52),
+     X14 = IVAL(X,56), X15 = IVAL(X,60);
    A = MDp->buffer[0];
    B = MDp->buffer[1];
    C = MDp->buffer[2];
@@ -225,7 +219,7 @@
    /* Process data */
    if (count == 512)
      { /* Full block of data to handle */
-       MDblock(MDp,(unsigned int *)X);
+       MDblock(MDp,X);
      }
    else if (count > 512) /* Check for count too large */
      { printf("\nError: MDupdate called with illegal count value %d."
@@ -236,8 +230,12 @@
      { /* Find out how many bytes and residual bits there are */
        byte = count >> 3;
        bit =  count & 7;
-       /* Copy X into XX since we need to modify it */
-       for (i=0;i<=byte;i++)   XX[i] = X[i];
+       /* Copy X into XX since we need to modify it. Only touch
+       ** X[byte] if it holds some of the bits, it may be past the
+       ** end of the caller's buffer otherwise.
+       */
+       for (i=0;i<byte;i++)    XX[i] = X[i];
+       XX[byte] = bit ? X[byte] : 0;
        for (i=byte+1;i<64;i++) XX[i] = 0;
        /* Add padding '1' bit and low-order zeros in last byte */
        mask = 1 << (7 - bit);
@@ -245,13 +243,13 @@
        /* If room for bit count, finish up with this block */
        if (byte <= 55)
          { for (i=0;i<8;i++) XX[56+i] = MDp->count[i];
-           MDblock(MDp,(unsigned int32 *)XX);
+           MDblock(MDp,XX);
          }
        else /* need to do two blocks to finish up */
-         { MDblock(MDp,(unsigned int32 *)XX);
+         { MDblock(MDp,XX);
            for (i=0;i<56;i++) XX[i] = 0;
            for (i=0;i<8;i++)  XX[56+i] = MDp->count[i];
-           MDblock(MDp,(unsigned int32 *)XX);
+           MDblock(MDp,XX);
          }
        /* Set flag saying we're done with MD computation */
        MDp->done = 1;
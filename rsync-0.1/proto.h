@@ -1,28 +1,63 @@
 /* This file is automatically generated with "make proto". DO NOT EDIT */
 
+void checksum_init(void);
 uint32 get_checksum1(char *buf,int len);
+void roll_checksum1(char *buf,int k,uint32 *s1v,uint32 *s2v);
+int cdc_next(char *buf,int len,int n);
 void get_checksum2(char *buf,int len,char *sum);
-void file_checksum(char *fname,char *sum,off_t size);
+void get_checksum2_multi(int count,char **bufs,int *lens,char **sums);
+void sum_init(void);
+void sum_update(char *p,int len);
+void sum_end(char *sum);
+int compute_file_checksum(char *fname,char *sum,off_t size);
+void file_checksum(char *fname,char *sum,struct stat *st);
 struct file_list *send_file_list(int f,int recurse,int argc,char *argv[]);
+void send_flist_segment(int f,struct file_list *flist);
 struct file_list *recv_file_list(int f);
+void recv_flist_segment(int f,struct file_list *flist,int f_copy);
 int do_cmd(char *cmd,char *machine,char *user,char *path,int *f_in,int *f_out);
 void do_server_sender(int argc,char *argv[]);
 void do_server_recv(int argc,char *argv[]);
 void usage(void);
 int main(int argc,char *argv[]);
-void match_sums(int f,struct sum_struct *s,char *buf,off_t len);
+void match_sums(int f,struct sum_struct *s,struct map_struct *m,off_t len);
 void recv_generator(char *fname,struct file_list *flist,int i,int f_out);
-int recv_files(int f_in,struct file_list *flist,char *local_name);
+void generate_files(int f_out,struct file_list *flist,char *local_name,
+		    int f_list);
+void generate_redo(int f_redo,struct file_list *flist,char *local_name,
+		   int f_out);
+int recv_files(int f_in,struct file_list *flist,char *local_name,int f_gen,
+	       int f_list);
 off_t send_files(struct file_list *flist,int f_out,int f_in);
-int write_total(void);
-int read_total(void);
+struct sum_struct *sum_cache_lookup(struct stat *st,int n);
+void sum_cache_remove(struct stat *st);
+void sum_cache_store(struct stat *st,struct sum_struct *s);
+void sum_cache_report(void);
+void sum_cache_trim(void);
+int file_sum_lookup(struct stat *st,char *sum);
+void file_sum_store(struct stat *st,char *sum);
+void file_sums_save(void);
+int64 literal_total(void);
+int64 compressed_total(void);
+void send_token(int f,int i,char *buf,off_t offset,int n);
+void send_hole(int f,off_t len);
+void see_token(char *data,int len);
+void see_hole(off_t len);
+int recv_token(int f,char **data,int *nblocks,off_t *hole);
+int64 write_total(void);
+int64 read_total(void);
+void write_flush(int f);
 void write_int(int f,int x);
+void write_longint(int f,int64 x);
 void write_buf(int f,char *buf,int len);
-void write_flush(int f);
 int readfd(int fd,char *buffer,int N);
+char *read_ptr(int f,int len);
 int read_int(int f);
+int64 read_longint(int f);
 void read_buf(int f,char *buf,int len);
-char *map_file(int fd,off_t len);
-void unmap_file(char *buf,off_t len);
+struct map_struct *map_file(int fd,off_t len);
+char *map_ptr(struct map_struct *map,off_t offset,off_t len);
+void map_release(struct map_struct *map,off_t offset,off_t len);
+void unmap_file(struct map_struct *map);
 int piped_child(char **command,int *f_in,int *f_out);
 void out_of_memory(char *str);
@@ -26,6 +26,9 @@ extern time_t starttime;
 extern char *backup_suffix;
 
 extern int block_size;
+extern int num_threads;
+extern int cdc_chunking;
+extern char *sum_cache_dir;
 extern int update_only;
 extern int make_backups;
 extern int preserve_links;
@@ -34,6 +37,12 @@ extern int preserve_devices;
 extern int preserve_uid;
 extern int preserve_gid;
 extern int preserve_times;
+extern int inplace;
+extern int sparse_files;
+
+/* the generator is in its second pass, redoing the files whose whole
+   file checksum didn't match with full length sums */
+static int redo_phase = 0;
 
 /*
   free a sums struct
@@ -46,6 +55,53 @@ static void free_sums(struct sum_struct *s)
 
 
 
+/*
+  the block size to use for a file of len bytes. Unless one was given
+  with -B it is about sqrt(len), so the number of blocks and their
+  size grow together, kept between BLOCK_SIZE and MAX_BLOCK_SIZE and
+  rounded down to a multiple of 8
+  */
+static int choose_block_size(off_t len)
+{
+  int n = 0, b;
+
+  if (block_size)
+    return block_size;
+
+  if (len >= (off_t)MAX_BLOCK_SIZE*MAX_BLOCK_SIZE)
+    return MAX_BLOCK_SIZE;
+
+  for (b=MAX_BLOCK_SIZE; b; b>>=1)
+    if ((off_t)(n+b)*(n+b) <= len)
+      n += b;
+
+  return MAX(n & ~7,BLOCK_SIZE);
+}
+
+
+/*
+  how many bytes of each strong sum to send for a file of len bytes in
+  blocks of n. A false match needs the 32 bit sum1 and the s2length
+  bytes of sum2 to both collide; the bits wanted grow with the number
+  of offsets searched times the number of blocks, roughly
+  2*log2(len) - log2(n), plus BLOCKSUM_BIAS to spare
+  */
+static int choose_sum_length(off_t len,int n)
+{
+  int b = BLOCKSUM_BIAS;
+  off_t l;
+
+  if (redo_phase)
+    return SUM_LENGTH;
+
+  for (l = len; l >>= 1; b += 2) ;
+  for (; (n >>= 1) && b; b--) ;
+
+  b = (b + 1 - 32 + 7) / 8;
+  return MIN(MAX(b,2),SUM_LENGTH);
+}
+
+
 /*
   send a sums struct down a fd
   */
@@ -56,24 +112,167 @@ static void send_sums(struct sum_struct *s,int f_out)
   /* tell the other guy how many we are going to be doing and how many
      bytes there are in the last chunk */
   write_int(f_out,s?s->count:0);
-  write_int(f_out,s?s->n:block_size);
+  write_int(f_out,s?s->n:choose_block_size(0));
   write_int(f_out,s?s->remainder:0);
+  write_int(f_out,s?s->s2length:SUM_LENGTH);
   if (s)
     for (i=0;i<s->count;i++) {
       write_int(f_out,s->sums[i].sum1);
-      write_buf(f_out,s->sums[i].sum2,SUM_LENGTH);
+      if (cdc_chunking)
+	write_int(f_out,s->sums[i].len);
+      write_buf(f_out,s->sums[i].sum2,s->s2length);
     }
   write_flush(f_out);
 }
 
 
+/*
+  fill in the sums for blocks from..to-1 of the file, whose offsets
+  and lengths are already set. Their data is let go of afterwards
+  */
+static void sum_blocks(struct sum_struct *s,struct map_struct *map,
+		       int from,int to)
+{
+  int i,j;
+  char *buf, *bufs[SUM_BATCH], *sums[SUM_BATCH];
+  int lens[SUM_BATCH];
+  off_t start, len;
+
+  if (to <= from) return;
+
+  start = s->sums[from].offset;
+  len = s->sums[to-1].offset + s->sums[to-1].len - start;
+  map_ptr(map,start,len);
+  buf = map->p;
+
+  for (i=from;i<to;i++) {
+    off_t offset = s->sums[i].offset;
+    int n1 = s->sums[i].len;
+
+    s->sums[i].sum1 = get_checksum1(buf+offset,n1);
+
+    if (verbose > 3)
+      fprintf(stderr,"chunk[%d] offset=%d len=%d sum1=%08x\n",
+	      i,(int)s->sums[i].offset,s->sums[i].len,s->sums[i].sum1);
+
+    /* the strong sums are done SUM_BATCH blocks at a time */
+    j = (i-from) % SUM_BATCH;
+    bufs[j] = buf+offset;
+    lens[j] = n1;
+    sums[j] = s->sums[i].sum2;
+    if (j == SUM_BATCH-1 || i == to-1)
+      get_checksum2_multi(j+1,bufs,lens,sums);
+  }
+
+  map_release(map,start,len);
+}
+
+
+/*
+  cut the file into content defined chunks averaging n bytes,
+  returning the chunks (just their offsets and lengths) and setting
+  *count
+  */
+static struct sum_buf *cdc_blocks(struct map_struct *map,off_t len,int n,
+				  int *count)
+{
+  struct sum_buf *sums = NULL;
+  char *buf = map->p;
+  off_t offset = 0, released = 0, avail = 0;
+  int i, size = 0;
+
+  for (i=0; offset < len; i++) {
+    if (offset + 4*n > avail && avail < len) {
+      avail = offset + MIN(len-offset,MAP_WINDOW);
+      map_ptr(map,offset,avail-offset);
+    }
+    if (i == size) {
+      size = size ? size*2 : 1024;
+      sums = (struct sum_buf *)realloc(sums,sizeof(sums[0])*size);
+      if (!sums) out_of_memory("cdc_blocks");
+    }
+    sums[i].offset = offset;
+    sums[i].len = cdc_next(buf+offset,MIN(len-offset,4*n),n);
+    sums[i].i = i;
+    offset += sums[i].len;
+    if (offset - released >= MAP_WINDOW) {
+      map_release(map,released,offset-released);
+      released = offset;
+    }
+  }
+
+  *count = i;
+  return sums;
+}
+
+
+/* the blocks still to be summed by the -j threads */
+static struct sum_struct *sum_job_s;
+static struct map_struct *sum_job_map;
+static int sum_job_next, sum_job_size;
+static pthread_mutex_t sum_job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *sum_worker(void *arg)
+{
+  int from;
+
+  while (1) {
+    pthread_mutex_lock(&sum_job_lock);
+    from = sum_job_next;
+    sum_job_next += sum_job_size;
+    pthread_mutex_unlock(&sum_job_lock);
+
+    if (from >= sum_job_s->count)
+      break;
+
+    sum_blocks(sum_job_s,sum_job_map,from,
+	       MIN(from+sum_job_size,sum_job_s->count));
+  }
+  return NULL;
+}
+
+/*
+  sum the blocks on num_threads threads (this one included), each
+  taking about SUM_REGION bytes of blocks at a time. The sums go
+  straight into their slots in s->sums
+  */
+static void threaded_sums(struct sum_struct *s,struct map_struct *map)
+{
+  pthread_t *tids;
+  int n;
+
+  tids = (pthread_t *)malloc(sizeof(tids[0])*num_threads);
+  if (!tids) out_of_memory("threaded_sums");
+
+  sum_job_s = s;
+  sum_job_map = map;
+  sum_job_next = 0;
+  sum_job_size = MAX(SUM_BATCH,SUM_REGION/s->n);
+
+  checksum_init();
+
+  for (n=0;n<num_threads-1;n++)
+    if (pthread_create(&tids[n],NULL,sum_worker,NULL) != 0)
+      break;
+
+  if (verbose > 2)
+    fprintf(stderr,"summing %d blocks on %d threads\n",s->count,n+1);
+
+  sum_worker(NULL);
+
+  while (n--)
+    pthread_join(tids[n],NULL);
+  free(tids);
+}
+
+
 /*
   generate a stream of signatures/checksums that describe a buffer
 
   generate approximately one checksum every n bytes
   */
 // 对buffer 的每n个字节生产checksum
-static struct sum_struct *generate_sums(char *buf,off_t len,int n)
+static struct sum_struct *generate_sums(struct map_struct *map,off_t len,int n)
 {
   int i;
   struct sum_struct *s;
@@ -87,42 +286,46 @@ static struct sum_struct *generate_sums(char *buf,off_t len,int n)
   s = (struct sum_struct *)malloc(sizeof(*s));
   if (!s) out_of_memory("generate_sums");
 
-  s->count = count;
-  s->remainder = remainder;
   s->n = n;
+  s->s2length = choose_sum_length(len,n);
   s->flength = len;
+  s->sums = NULL;
 
-  if (count==0) {
-    s->sums = NULL;
-    return s;
-  }
-
-  if (verbose > 3)
-    fprintf(stderr,"count=%d rem=%d n=%d flength=%d\n",
-	    s->count,s->remainder,s->n,(int)s->flength);
+  if (cdc_chunking) {
+    remainder = 0;
+    if (len > 0)
+      s->sums = cdc_blocks(map,len,n,&count);
+  } else if (count > 0) {
+    s->sums = (struct sum_buf *)malloc(sizeof(s->sums[0])*count);
+    if (!s->sums) out_of_memory("generate_sums");
 
-  s->sums = (struct sum_buf *)malloc(sizeof(s->sums[0])*s->count);
-  if (!s->sums) out_of_memory("generate_sums");
-  
-  for (i=0;i<count;i++) {
+    for (i=0;i<count;i++) {
 	  // 考虑 len < n
 	  // 不足 n 即一个数据快的情况下有
-    int n1 = MIN(len,n);
+      s->sums[i].offset = offset;
+      s->sums[i].len = MIN(len-offset,n);
+      s->sums[i].i = i;
+      offset += s->sums[i].len;
+    }
+  }
 
-    s->sums[i].sum1 = get_checksum1(buf,n1);
-    get_checksum2(buf,n1,s->sums[i].sum2);
+  s->count = count;
+  s->remainder = remainder;
 
-    s->sums[i].offset = offset;
-    s->sums[i].len = n1;
-    s->sums[i].i = i;
+  if (count==0)
+    return s;
 
-    if (verbose > 3)
-      fprintf(stderr,"chunk[%d] offset=%d len=%d sum1=%08x\n",
-	      i,(int)s->sums[i].offset,s->sums[i].len,s->sums[i].sum1);
+  if (verbose > 3)
+    fprintf(stderr,"count=%d rem=%d n=%d s2length=%d flength=%d\n",
+	    s->count,s->remainder,s->n,s->s2length,(int)s->flength);
 
-    len -= n1;
-    buf += n1;
-    offset += n1;
+  if (num_threads > 1 && len >= 2*SUM_REGION) {
+    threaded_sums(s,map);
+  } else {
+    /* a window at a time, so only that much is resident */
+    int step = MAX(SUM_BATCH,MAP_WINDOW/n);
+    for (i=0;i<count;i+=step)
+      sum_blocks(s,map,i,MIN(i+step,count));
   }
 
   return s;
@@ -135,9 +338,10 @@ static struct sum_struct *generate_sums(char *buf,off_t len,int n)
 static struct sum_struct *receive_sums(int f)
 {
   struct sum_struct *s;
-  int i;
+  int i,j,n,size;
   off_t offset = 0;
   int block_len;
+  char *p = NULL;
 
   s = (struct sum_struct *)malloc(sizeof(*s));
   if (!s) out_of_memory("receive_sums");
@@ -145,11 +349,17 @@ static struct sum_struct *receive_sums(int f)
   s->count = read_int(f);
   s->n = read_int(f);
   s->remainder = read_int(f);  
+  s->s2length = read_int(f);
   s->sums = NULL;
 
   if (verbose > 3)
-    fprintf(stderr,"count=%d n=%d rem=%d\n",
-	    s->count,s->n,s->remainder);
+    fprintf(stderr,"count=%d n=%d rem=%d s2length=%d\n",
+	    s->count,s->n,s->remainder,s->s2length);
+
+  if (s->s2length < 0 || s->s2length > SUM_LENGTH) {
+    fprintf(stderr,"invalid checksum length %d\n",s->s2length);
+    exit(1);
+  }
 
   block_len = s->n;
 
@@ -159,18 +369,33 @@ static struct sum_struct *receive_sums(int f)
   s->sums = (struct sum_buf *)malloc(sizeof(s->sums[0])*s->count);
   if (!s->sums) out_of_memory("receive_sums");
 
-  for (i=0;i<s->count;i++) {
-    s->sums[i].sum1 = read_int(f);
-    read_buf(f,s->sums[i].sum2,SUM_LENGTH);
-
-    s->sums[i].offset = offset;
-    s->sums[i].i = i;
+  /* decode the sums a buffer full at a time rather than one
+     read_int() and read_buf() per chunk. Chunks cut by content carry
+     their length as well */
+  size = 4 + (cdc_chunking?4:0) + s->s2length;
+  for (i=j=n=0;i<s->count;i++,j++) {
+    if (j == n) {
+      n = MIN(s->count-i,IO_BUFFER_SIZE/size);
+      p = read_ptr(f,n*size);
+      j = 0;
+    }
+    s->sums[i].sum1 = IVAL(p,0);
+    p += 4;
 
-    if (i == s->count-1 && s->remainder != 0) {
+    if (cdc_chunking) {
+      s->sums[i].len = IVAL(p,0);
+      p += 4;
+    } else if (i == s->count-1 && s->remainder != 0) {
       s->sums[i].len = s->remainder;
     } else {
       s->sums[i].len = s->n;
     }
+
+    bcopy(p,s->sums[i].sum2,s->s2length);
+    p += s->s2length;
+
+    s->sums[i].offset = offset;
+    s->sums[i].i = i;
     offset += s->sums[i].len;
 
     if (verbose > 3)
@@ -221,10 +446,10 @@ void recv_generator(char *fname,struct file_list *flist,int i,int f_out)
 {  
   int fd;
   struct stat st;
-  char *buf;
+  struct map_struct *map;
   struct sum_struct *s;
   char sum[SUM_LENGTH];
-  int statret;
+  int statret, n;
 
   if (verbose > 2)
     fprintf(stderr,"recv_generator(%s)\n",fname);
@@ -305,7 +530,7 @@ void recv_generator(char *fname,struct file_list *flist,int i,int f_out)
   }
 
   if (always_checksum && S_ISREG(st.st_mode)) {
-    file_checksum(fname,sum,st.st_size);
+    file_checksum(fname,sum,&st);
   }
 
   // 接收端对比是否有修改
@@ -326,93 +551,519 @@ void recv_generator(char *fname,struct file_list *flist,int i,int f_out)
     return;
   }
 
-  if (st.st_size > 0) {
-    buf = map_file(fd,st.st_size);
-    if (!buf) {
+  /* an unchanged basis file gets its sums from the cache without
+     being read. The redo pass reads it, in case the entry was bad */
+  n = choose_block_size(st.st_size);
+  s = redo_phase ? NULL : sum_cache_lookup(&st,n);
+  if (s) {
+    s->s2length = choose_sum_length(st.st_size,n);
+  } else {
+    map = map_file(fd,st.st_size);
+    if (!map) {
       fprintf(stderr,"mmap : %s\n",strerror(errno));
       close(fd);
       return;
     }
-  } else {
-    buf = NULL;
-  }
 
-  if (verbose > 3)
-    fprintf(stderr,"mapped %s of size %d\n",fname,(int)st.st_size);
+    if (verbose > 3)
+      fprintf(stderr,"mapped %s of size %d\n",fname,(int)st.st_size);
 
-  s = generate_sums(buf,st.st_size,BLOCK_SIZE);
+    s = generate_sums(map,st.st_size,n);
+    unmap_file(map);
+  }
 
   write_int(f_out,i);
   send_sums(s,f_out);
   write_flush(f_out);
 
   close(fd);
-  unmap_file(buf,st.st_size);
 
   free_sums(s);
 }
 
 
 
-static void receive_data(int f_in,char *buf,int fd)
+/*
+  the generator's first pass. Before starting on a segment of the file
+  list it asks the sender for the next one, so that is on its way while
+  this one is worked through. The receiver passes the segments on
+  through f_list
+  */
+void generate_files(int f_out,struct file_list *flist,char *local_name,
+		    int f_list)
+{
+  int i = 0;
+
+  while (1) {
+    write_int(f_out,FLIST_MORE);
+    write_flush(f_out);
+
+    for (; i < flist->count; i++) {
+      if (S_ISDIR(flist->files[i].mode)) {
+	if (mkdir(flist->files[i].name,flist->files[i].mode) != 0 &&
+	    errno != EEXIST) {
+	  fprintf(stderr,"mkdir %s : %s\n",
+		  flist->files[i].name,strerror(errno));
+	}
+	continue;
+      }
+      recv_generator(local_name?local_name:flist->files[i].name,
+		     flist,i,f_out);
+    }
+
+    if (read_int(f_list) != FLIST_SEGMENT)
+      break;
+    recv_flist_segment(f_list,flist,-1);
+  }
+
+  write_int(f_out,-1);
+  write_flush(f_out);
+}
+
+
+/*
+  the generator's second pass: send sums again, full length this time,
+  for each file the receiver reports on f_redo as having failed its
+  whole file checksum, until it sends -1
+  */
+void generate_redo(int f_redo,struct file_list *flist,char *local_name,
+		   int f_out)
 {
-  int i,n,remainder,len,count;
-  int size = 0;
-  char *buf2=NULL;
+  int i;
+
+  redo_phase = 1;
+
+  while ((i = read_int(f_redo)) != -1)
+    recv_generator(local_name?local_name:flist->files[i].name,
+		   flist,i,f_out);
+
+  write_int(f_out,-1);
+  write_flush(f_out);
+
+  sum_cache_report();
+  file_sums_save();
+}
+
+
+
+/*
+  with -k the sums of a file the receiver has just written go into the
+  cache, while it is still in memory, so the next run finds them
+  without reading the file if it has not changed by then
+  */
+static void cache_new_file(char *fname)
+{
+  int fd;
+  struct stat st;
+  struct map_struct *map;
+  struct sum_struct *s;
+
+  fd = open(fname,O_RDONLY);
+  if (fd == -1) return;
+
+  if (fstat(fd,&st) != 0 || st.st_size == 0) {
+    close(fd);
+    return;
+  }
+
+  map = map_file(fd,st.st_size);
+  if (map) {
+    s = generate_sums(map,st.st_size,choose_block_size(st.st_size));
+    sum_cache_store(&st,s);
+    free_sums(s);
+    unmap_file(map);
+  }
+  close(fd);
+}
+
+/*
+  the receiver's output. Literal data is copied into wbuf and matched
+  data is pointed at where it is in the basis file, and it all goes
+  out in one writev once WRITE_BATCH bytes are waiting. The basis
+  data is let go of after that
+  */
+static struct iovec wiov[WRITE_IOVS];
+static off_t wbasis[WRITE_IOVS];	/* where each piece is in the basis, or -1 */
+static int wbasis_len[WRITE_IOVS];
+static int wiovs, wpending;
+static char *wbuf = NULL;
+static int wbuf_len;
+static int write_failed;
+
+/* bytes of matched data that never came through user space */
+static int64 kernel_copied = 0, kernel_cloned = 0;
+static int no_clone = 0, no_copy_range = 0, no_punch = 0;
+static off_t clone_size;
+
+/* with -H, what is known of where the basis file's data is: from
+   data_from up to data_start is a hole and then there is data up to
+   data_end */
+static off_t data_from, data_start, data_end;
+
+static void flush_output(int fd,struct map_struct *map)
+{
+  struct iovec *iov = wiov;
+  int cnt = wiovs, i, n;
+
+  while (cnt > 0 && !write_failed) {
+    n = writev(fd,iov,cnt);
+    if (n <= 0) {
+      fprintf(stderr,"write failed : %s\n",strerror(errno));
+      write_failed = 1;
+      break;
+    }
+    while (cnt > 0 && n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  for (i=0;i<wiovs;i++)
+    if (wbasis[i] != -1)
+      map_release(map,wbasis[i],wbasis_len[i]);
+
+  wiovs = wpending = wbuf_len = 0;
+}
+
+/* add len bytes at p to the output. basis is where they are in the
+   basis file, or -1 for data which has to be copied */
+static void add_output(int fd,struct map_struct *map,char *p,int len,
+		       off_t basis)
+{
+  if (!wbuf) {
+    wbuf = (char *)malloc(WRITE_BATCH);
+    if (!wbuf) out_of_memory("add_output");
+  }
+
+  for (; basis == -1 && len > WRITE_BATCH; p += WRITE_BATCH, len -= WRITE_BATCH)
+    add_output(fd,map,p,WRITE_BATCH,-1);
+
+  if (wiovs == WRITE_IOVS || (basis == -1 && wbuf_len + len > WRITE_BATCH))
+    flush_output(fd,map);
+
+  if (basis == -1) {
+    bcopy(p,wbuf+wbuf_len,len);
+    p = wbuf+wbuf_len;
+    wbuf_len += len;
+    if (wiovs > 0 && wbasis[wiovs-1] == -1) {
+      wiov[wiovs-1].iov_len += len;
+      len = 0;
+    }
+  }
+
+  if (len > 0) {
+    wiov[wiovs].iov_base = p;
+    wiov[wiovs].iov_len = len;
+    wbasis[wiovs] = basis;
+    wbasis_len[wiovs] = len;
+    wiovs++;
+  }
+
+  wpending += len;
+  if (wpending >= WRITE_BATCH)
+    flush_output(fd,map);
+}
+
+/*
+  copy len bytes at offset in the basis file to out in the new file
+  without them passing through user space: shared with a reflink
+  where the file system can and the offsets are aligned, otherwise
+  with copy_file_range. Returns how many were copied, the caller
+  writes the rest
+  */
+static off_t kernel_copy(int fd,struct map_struct *map,off_t offset,
+			 off_t out,off_t len)
+{
+  off_t done = 0;
+  int64 in;
+  int n;
+
+#ifdef FICLONERANGE
+  if (!no_clone && offset % clone_size == 0 && out % clone_size == 0 &&
+      len >= clone_size) {
+    struct file_clone_range r;
+    r.src_fd = map->fd;
+    r.src_offset = offset;
+    r.src_length = len - len % clone_size;
+    r.dest_offset = out;
+    if (ioctl(fd,FICLONERANGE,&r) == 0) {
+      done = r.src_length;
+      kernel_cloned += done;
+      lseek(fd,out+done,SEEK_SET);
+    } else {
+      no_clone = 1;
+    }
+  }
+#endif
+
+#ifdef __NR_copy_file_range
+  while (done < len && !no_copy_range) {
+    in = offset+done;
+    n = syscall(__NR_copy_file_range,map->fd,&in,fd,NULL,
+		(size_t)MIN(len-done,1<<30),0);
+    if (n <= 0) {
+      no_copy_range = 1;
+      break;
+    }
+    done += n;
+    kernel_copied += n;
+  }
+#endif
+
+  return done;
+}
+
+/*
+  leave len bytes at out in the new file as a hole. In a new file that
+  just means not writing them. With -I the old data there is punched
+  out, or failing that written over with zeros
+  */
+static void skip_output(int fd,struct map_struct *map,off_t out,off_t len)
+{
+  static char zeros[CHUNK_SIZE];
+
+  flush_output(fd,map);
+  if (inplace) {
+#if defined(__NR_fallocate) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (!no_punch && sizeof(off_t) == sizeof(long) &&
+	syscall(__NR_fallocate,fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		out,len) == 0) {
+      lseek(fd,out+len,SEEK_SET);
+      return;
+    }
+    no_punch = 1;
+#endif
+    for (; len > 0; len -= CHUNK_SIZE)
+      add_output(fd,map,zeros,(int)MIN(len,CHUNK_SIZE),-1);
+    return;
+  }
+  lseek(fd,out+len,SEEK_SET);
+}
+
+/*
+  copy a run of matched blocks from the basis file to out, or leave a
+  hole there if hole is set. A long run is copied in the kernel. The
+  data is still read, a window at a time, for the whole file checksum
+  and the -z dictionary.
+
+  With -I the basis file is the file being written. A run that is
+  already in place is skipped over, and one that overlaps where it
+  goes (it can only be further on) is copied through user space
+  */
+static void copy_run(int fd,struct map_struct *map,off_t offset,
+		     off_t out,off_t len,int hole)
+{
+  int overlap = inplace && offset < out+len;
+  off_t done = 0;
+  char *p;
+  int k;
+
+  if (hole) {
+    skip_output(fd,map,out,len);
+    done = len;
+  } else if (inplace && offset == out) {
+    flush_output(fd,map);
+    lseek(fd,out+len,SEEK_SET);
+    done = len;
+  } else if (len >= COPY_MIN && !overlap) {
+    flush_output(fd,map);
+    done = kernel_copy(fd,map,offset,out,len);
+  }
+
+  while (len > 0) {
+    k = MIN(len,MAP_WINDOW);
+    p = map_ptr(map,offset,k);
+    see_token(p,k);
+    sum_update(p,k);
+    if (done >= k) {
+      map_release(map,offset,k);
+      done -= k;
+    } else {
+      if (done > 0)
+	map_release(map,offset,done);
+      add_output(fd,map,p+done,k-done,overlap ? -1 : offset+done);
+      done = 0;
+    }
+    offset += k;
+    len -= k;
+  }
+}
+
+/* with -H the holes in a run of matched blocks stay holes in the new
+   file, the rest is copied */
+static void copy_blocks(int fd,struct map_struct *map,off_t offset,
+			off_t out,off_t len)
+{
+  off_t n;
+
+  while (sparse_files && len > 0 && !(inplace && offset == out)) {
+    if (offset < data_from || offset >= data_end) {
+      data_from = offset;
+      data_start = lseek(map->fd,offset,SEEK_DATA);
+      if (data_start == -1) {
+	if (errno != ENXIO) break;
+	data_start = data_end = map->size;
+      } else {
+	data_end = lseek(map->fd,data_start,SEEK_HOLE);
+	if (data_end == -1) break;
+      }
+    }
+    if (offset < data_start) {
+      n = MIN(data_start-offset,len);
+      copy_run(fd,map,offset,out,n,1);
+    } else {
+      n = MIN(data_end-offset,len);
+      copy_run(fd,map,offset,out,n,0);
+    }
+    offset += n;
+    out += n;
+    len -= n;
+  }
+
+  if (len > 0)
+    copy_run(fd,map,offset,out,len,0);
+}
+
+/*
+  build the new file from the sender's tokens. Returns 1 if what was
+  written matches the sender's whole file checksum, 0 if not
+  */
+static int receive_data(int f_in,struct map_struct *map,off_t blen,int fd)
+{
+  int i,n,remainder,count,nblocks;
+  char *data;
+  struct sum_buf *chunks=NULL;
+  int nchunks = 0, ok = 1;
   off_t offset = 0;
-  off_t offset2;
+  off_t offset2,len,hole;
+  char file_sum1[SUM_LENGTH];
+  char file_sum2[SUM_LENGTH];
+  struct stat st;
 
   count = read_int(f_in);
   n = read_int(f_in);
   remainder = read_int(f_in);
 
-  for (i=read_int(f_in); i != 0; i=read_int(f_in)) {
-    if (i > 0) {
+  sum_init();
+
+  write_failed = 0;
+  data_from = data_start = data_end = 0;
+  clone_size = (fstat(fd,&st) == 0 && st.st_blksize > 0) ? st.st_blksize : 4096;
+
+  /* with -I the basis is written over as the data comes in, so its
+     chunks have to be found before anything is written */
+  if (cdc_chunking && inplace && count > 0 && blen > 0)
+    chunks = cdc_blocks(map,blen,n,&nchunks);
+
+  for (i=recv_token(f_in,&data,&nblocks,&hole); i != 0;
+       i=recv_token(f_in,&data,&nblocks,&hole)) {
+    if (i == TOKEN_HOLE) {
+      if (verbose > 3)
+	fprintf(stderr,"hole of %.0f at %.0f\n",(double)hole,(double)offset);
+      if (hole < 0) {
+	ok = 0;
+	continue;
+      }
+      skip_output(fd,map,offset,hole);
+      see_hole(hole);
+      offset += hole;
+    } else if (i > 0) {
 		// 有数据块发送过来
 		// 有差异数据块才会触发
-      if (i > size) {
-	if (buf2) free(buf2);
-	buf2 = (char *)malloc(i);
-	size = i;
-	if (!buf2) out_of_memory("receive_data");
-      }
-
       if (verbose > 3)
 	fprintf(stderr,"data recv %d at %d\n",i,(int)offset);
 
-      read_buf(f_in,buf2,i);
-      write(fd,buf2,i);
+      sum_update(data,i);
+      add_output(fd,map,data,i,-1);
       offset += i;
     } else {
 		// 当前相同的数据块，就不用发buf过来，
 		// 从本地文件buf 拿
+      /* nblocks blocks from block i, they are next to each other in
+	 the basis file so the run is copied in one go */
       i = -(i+1);
-      offset2 = i*n;
-      len = n;
-      if (i == count-1 && remainder != 0)
-	len = remainder;
+      if (nblocks <= 0 || i+nblocks > count) {
+	ok = 0;
+	continue;
+      }
+      offset2 = (off_t)i*n;
+      len = (off_t)nblocks*n;
+      if (i+nblocks == count && remainder != 0)
+	len -= n - remainder;
+
+      /* content defined chunks are found by cutting up the basis
+	 file the same way the generator did */
+      if (cdc_chunking) {
+	if (!chunks && blen > 0)
+	  chunks = cdc_blocks(map,blen,n,&nchunks);
+	if (nchunks != count) {
+	  ok = 0;
+	  continue;
+	}
+	offset2 = chunks[i].offset;
+	len = chunks[i+nblocks-1].offset + chunks[i+nblocks-1].len - offset2;
+      }
 
       if (verbose > 3)
-	fprintf(stderr,"chunk[%d] of size %d at %d offset=%d\n",
-		i,len,(int)offset2,(int)offset);
+	fprintf(stderr,"chunk[%d] x %d of size %d at %d offset=%d\n",
+		i,nblocks,(int)len,(int)offset2,(int)offset);
 
-      write(fd,buf+offset2,len);
+      copy_blocks(fd,map,offset2,offset,len);
       offset += len;
     }
   }
-  if (buf2) free(buf2);
+  if (chunks) free(chunks);
+  flush_output(fd,map);
+  /* a file ending in a hole has to be extended to its length */
+  if (inplace || sparse_files)
+    ftruncate(fd,offset);
+
+  sum_end(file_sum1);
+  read_buf(f_in,file_sum2,SUM_LENGTH);
+  return ok && !write_failed && memcmp(file_sum1,file_sum2,SUM_LENGTH) == 0;
 }
 
 
 
-int recv_files(int f_in,struct file_list *flist,char *local_name)
+/* read and throw away the data for a file that can't be written */
+static void discard_data(int f_in)
+{
+  char *data, sum[SUM_LENGTH];
+  int nblocks;
+  off_t hole;
+
+  read_int(f_in);
+  read_int(f_in);
+  read_int(f_in);
+  while (recv_token(f_in,&data,&nblocks,&hole) != 0)
+    ;
+  read_buf(f_in,sum,SUM_LENGTH);
+}
+
+/*
+  files that fail the whole file checksum are left alone and their
+  index is written to f_gen, so the generator can send them round
+  again with full length sums once the first pass is done. Segments
+  of the file list come in among the files and go on to the generator
+  through f_list. A file that can't be opened is skipped. Returns the
+  number of files that still failed the checksum the second time
+  */
+int recv_files(int f_in,struct file_list *flist,char *local_name,int f_gen,
+	       int f_list)
 {  
-  int fd1,fd2;
+  int fd1,fd2,widened;
   struct stat st;
   char *fname;
   char fnametmp[MAXPATHLEN];
-  char *buf;
+  struct map_struct *map;
   int i;
+  int phase = 0;
+  int failed = 0;
 
   if (verbose > 2)
     fprintf(stderr,"recv_files(%d) starting\n",flist->count);
@@ -420,7 +1071,28 @@ int recv_files(int f_in,struct file_list *flist,char *local_name)
   while (1) 
     {
       i = read_int(f_in);
-      if (i == -1) break;
+      if (i == -1) {
+	if (phase == 0) {
+	  phase++;
+	  write_int(f_gen,-1);
+	  write_flush(f_gen);
+	  if (verbose > 2)
+	    fprintf(stderr,"recv_files phase=%d\n",phase);
+	  continue;
+	}
+	break;
+      }
+
+      /* the rest of the file list is for the generator */
+      if (i == FLIST_SEGMENT) {
+	recv_flist_segment(f_in,flist,f_list);
+	continue;
+      }
+      if (i == FLIST_END) {
+	write_int(f_list,FLIST_END);
+	write_flush(f_list);
+	continue;
+      }
 
       fname = flist->files[i].name;
 
@@ -434,74 +1106,141 @@ int recv_files(int f_in,struct file_list *flist,char *local_name)
       fd1 = open(fname,O_RDONLY|O_CREAT,flist->files[i].mode);
 
       if (fd1 == -1) {
-	fprintf(stderr,"recv_files failed to open %s\n",fname);
-	return -1;
+	fprintf(stderr,"recv_files failed to open %s : %s\n",
+		fname,strerror(errno));
+	discard_data(f_in);
+	continue;
       }
 
       if (fstat(fd1,&st) != 0) {
 	fprintf(stderr,"fstat %s : %s\n",fname,strerror(errno));
 	close(fd1);
-	return -1;
+	discard_data(f_in);
+	continue;
       }
 
       if (!S_ISREG(st.st_mode)) {
 	fprintf(stderr,"%s : not a regular file\n",fname);
 	close(fd1);
-	return -1;
+	discard_data(f_in);
+	continue;
       }
 
-      if (st.st_size > 0) {
-	buf = map_file(fd1,st.st_size);
-	if (!buf) return -1;
-      } else {
-	buf = NULL;
+      map = map_file(fd1,st.st_size);
+      if (!map) {
+	fprintf(stderr,"map_file %s : %s\n",fname,strerror(errno));
+	close(fd1);
+	discard_data(f_in);
+	continue;
       }
 
       if (verbose > 2)
 	fprintf(stderr,"mapped %s of size %d\n",fname,(int)st.st_size);
 
-      /* open tmp file */
-      sprintf(fnametmp,"%s.XXXXXX",fname);
-      if (NULL == mktemp(fnametmp)) 
-	return -1;
-      fd2 = open(fnametmp,O_WRONLY|O_CREAT,st.st_mode);
-      if (fd2 == -1) return -1;
+      /* open tmp file, or with -I the file itself. A file without
+	 owner write permission, such as one just created from a read
+	 only original, is made writable while it is updated and its
+	 mode put back afterwards */
+      widened = 0;
+      if (inplace) {
+	fd2 = open(fname,O_RDWR);
+	if (fd2 == -1 && errno == EACCES && !(st.st_mode & S_IWUSR)) {
+	  if (chmod(fname,(st.st_mode & 07777) | S_IWUSR) == 0) {
+	    widened = 1;
+	    fd2 = open(fname,O_RDWR);
+	  } else {
+	    errno = EACCES;
+	  }
+	}
+      } else {
+	sprintf(fnametmp,"%s.XXXXXX",fname);
+	if (NULL == mktemp(fnametmp))
+	  fd2 = -1;
+	else
+	  fd2 = open(fnametmp,O_WRONLY|O_CREAT,st.st_mode);
+      }
+      if (fd2 == -1) {
+	fprintf(stderr,"recv_files failed to open %s : %s\n",
+		inplace ? fname : fnametmp,strerror(errno));
+	if (widened)
+	  chmod(fname,st.st_mode & 07777);
+	unmap_file(map);
+	close(fd1);
+	discard_data(f_in);
+	continue;
+      }
 
       if (verbose)
 	fprintf(stderr,"%s\n",fname);
 
       /* recv file data */
-      receive_data(f_in,buf,fd2);
+      if (!receive_data(f_in,map,st.st_size,fd2)) {
+	close(fd1);
+	close(fd2);
+	if (widened)
+	  chmod(fname,st.st_mode & 07777);
+	if (!inplace)
+	  unlink(fnametmp);
+	unmap_file(map);
+	sum_cache_remove(&st);
+	if (phase == 0) {
+	  if (verbose > 1)
+	    fprintf(stderr,"redoing %s(%d)\n",fname,i);
+	  write_int(f_gen,i);
+	} else if (inplace) {
+	  fprintf(stderr,"file corruption in %s\n",fname);
+	  failed++;
+	} else {
+	  fprintf(stderr,"file corruption in %s, left unchanged\n",fname);
+	  failed++;
+	}
+	continue;
+      }
 
       close(fd1);
       close(fd2);
-
-      if (verbose > 2)
-	fprintf(stderr,"renaming %s to %s\n",fnametmp,fname);
-
-      if (make_backups) {
-	char fnamebak[MAXPATHLEN];
-	sprintf(fnamebak,"%s%s",fname,backup_suffix);
-	if (rename(fname,fnamebak) != 0) {
-	  fprintf(stderr,"rename %s %s : %s\n",fname,fnamebak,strerror(errno));
-	  exit(1);
+      if (widened)
+	chmod(fname,st.st_mode & 07777);
+
+      if (!inplace) {
+	if (verbose > 2)
+	  fprintf(stderr,"renaming %s to %s\n",fnametmp,fname);
+
+	if (make_backups) {
+	  char fnamebak[MAXPATHLEN];
+	  sprintf(fnamebak,"%s%s",fname,backup_suffix);
+	  if (rename(fname,fnamebak) != 0) {
+	    fprintf(stderr,"rename %s %s : %s\n",fname,fnamebak,strerror(errno));
+	    exit(1);
+	  }
 	}
-      }
 
-      /* move tmp file over real file */
-      if (rename(fnametmp,fname) != 0) {
-	fprintf(stderr,"rename %s -> %s : %s\n",fnametmp,fname,strerror(errno));
+	/* move tmp file over real file */
+	if (rename(fnametmp,fname) != 0) {
+	  fprintf(stderr,"rename %s -> %s : %s\n",fnametmp,fname,strerror(errno));
+	}
       }
 
-      unmap_file(buf,st.st_size);
+      unmap_file(map);
 
       set_perms(fname,&flist->files[i]);
+
+      if (sum_cache_dir) {
+	sum_cache_remove(&st);
+	cache_new_file(fname);
+      }
     }
 
+  sum_cache_trim();
+
+  if (verbose > 1 && kernel_copied + kernel_cloned > 0)
+    fprintf(stderr,"matched data copied in the kernel %.0f bytes, shared %.0f bytes\n",
+	    (double)kernel_copied,(double)kernel_cloned);
+
   if (verbose > 2)
     fprintf(stderr,"recv_files finished\n");
   
-  return 0;
+  return failed;
 }
 
 
@@ -510,11 +1249,12 @@ off_t send_files(struct file_list *flist,int f_out,int f_in)
 { 
   int fd;
   struct sum_struct *s;
-  char *buf;
+  struct map_struct *map;
   struct stat st;
   char fname[MAXPATHLEN];  
   off_t total=0;
   int i;
+  int phase = 0;
 
   if (verbose > 2)
     fprintf(stderr,"send_files starting\n");
@@ -522,7 +1262,25 @@ off_t send_files(struct file_list *flist,int f_out,int f_in)
   while (1) 
     {
       i = read_int(f_in);
-      if (i == -1) break;
+      if (i == -1) {
+	/* the end of the generator's first pass, pass it on to the
+	   receiver and carry on with any files it redoes */
+	if (phase == 0) {
+	  phase++;
+	  write_int(f_out,-1);
+	  write_flush(f_out);
+	  if (verbose > 2)
+	    fprintf(stderr,"send_files phase=%d\n",phase);
+	  continue;
+	}
+	break;
+      }
+
+      if (i == FLIST_MORE) {
+	send_flist_segment(f_out,flist);
+	write_flush(f_out);
+	continue;
+      }
 
       fname[0] = 0;
       if (flist->files[i].dir) {
@@ -549,12 +1307,8 @@ off_t send_files(struct file_list *flist,int f_out,int f_in)
       if (fstat(fd,&st) != 0) 
 	return -1;
       
-      if (st.st_size > 0) {
-	buf = map_file(fd,st.st_size);
-	if (!buf) return -1;
-      } else {
-	buf = NULL;
-      }
+      map = map_file(fd,st.st_size);
+      if (!map) return -1;
 
       if (verbose > 2)
 	fprintf(stderr,"send_files mapped %s of size %d\n",
@@ -569,10 +1323,10 @@ off_t send_files(struct file_list *flist,int f_out,int f_in)
       if (verbose > 2)
 	fprintf(stderr,"calling match_sums %s\n",fname);
       
-      match_sums(f_out,s,buf,st.st_size);
+      match_sums(f_out,s,map,st.st_size);
       write_flush(f_out);
       
-      unmap_file(buf,st.st_size);
+      unmap_file(map);
       close(fd);
 
       free_sums(s);
@@ -18,13 +18,51 @@
 */
 
 #define BLOCK_SIZE 700
+#define MAX_BLOCK_SIZE (1<<17)
+#define IO_BUFFER_SIZE (32*1024)
+#define ROLL_BATCH 16 /* offsets checked per pass of the rolling search */
+#define SUM_BATCH 64 /* blocks per call to get_checksum2_multi() */
+#define SEARCH_REGION (4*1024*1024) /* bytes per job for -j searches */
+#define SEARCH_AHEAD 4 /* regions per thread searched ahead of the output */
+#define SUM_REGION (4*1024*1024) /* bytes of blocks per -j signature job */
+#define CSUM_QUEUE 256 /* files queued for the -j -c checksum threads */
+#define FLIST_SEGMENT_SIZE (16*1024) /* bytes of file list per segment, well under a pipe's buffer */
+#define MAP_WINDOW (64*1024*1024) /* bytes of a mapped file kept resident */
+#define READ_CHUNK (1024*1024) /* bytes per pread with -M read */
+#define READ_AHEAD (16*1024*1024) /* readahead asked for with -M read */
+#define WRITE_BATCH (256*1024) /* bytes the receiver gathers for a writev */
+#define WRITE_IOVS 64 /* pieces in one writev */
+#define COPY_MIN (64*1024) /* matched runs this long are copied in the kernel */
+#define CHUNK_SIZE (32*1024) /* largest piece of literal data in a token */
+#define SUM_CACHE_SIZE (64*1024*1024) /* bytes kept by the -k cache */
+#define SUM_INDEX_AGE (30*24*60*60) /* -c index records unused this long go */
+#define COMPRESS_LEVEL 6 /* zlib level for -z, 1 is ~4x faster on text */
 #define RSYNC_RSH_ENV "RSYNC_RSH"
 #define RSYNC_RSH "rsh"
 #define RSYNC_NAME "rsync"
 #define BACKUP_SUFFIX "~"
 
 /* update this if you make incompatible changes */
-#define PROTOCOL_VERSION 6
+#define PROTOCOL_VERSION 12
+
+/* optional protocol features, the client asks for them after sending
+   its version and the server answers with the ones it will use */
+#define PROTO_CDC (1<<0)	/* content defined chunks */
+#define PROTO_COMPRESS (1<<1)	/* deflated literal data */
+#define PROTO_INPLACE (1<<2)	/* no block is used after it is overwritten */
+#define PROTO_SPARSE (1<<3)	/* holes in files are sent as holes */
+#define PROTO_SUPPORTED (PROTO_CDC|PROTO_COMPRESS|PROTO_INPLACE|PROTO_SPARSE)
+
+/* the file list is sent a segment at a time. The generator asks for
+   the next segment with FLIST_MORE and the sender answers with
+   FLIST_SEGMENT and the entries, or FLIST_END once it has no more */
+#define FLIST_MORE (-2)
+#define FLIST_SEGMENT (-3)
+#define FLIST_END (-4)
+
+/* the token for a hole, followed by its length. No block token can
+   have this value */
+#define TOKEN_HOLE (-0x7fffffff)
 
 #include "config.h"
 
@@ -85,7 +123,20 @@
 #include <errno.h>
 
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <utime.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/falloc.h>
+/* unistd.h only has these with _GNU_SOURCE */
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+#endif
 
 #ifndef S_ISLNK
 #define S_ISLNK(mode) (((mode) & S_IFLNK) == S_IFLNK)
@@ -109,6 +160,18 @@
 #define uint32 unsigned int32
 #endif
 
+#ifndef int64
+#if (SIZEOF_LONG == 8)
+#define int64 long
+#else
+#define int64 long long
+#endif
+#endif
+
+#ifndef uint64
+#define uint64 unsigned int64
+#endif
+
 
 #ifndef MIN
 #define MIN(a,b) ((a)<(b)?(a):(b))
@@ -118,9 +181,23 @@
 #define MAX(a,b) ((a)>(b)?(a):(b))
 #endif
 
+/* vector checksum code is built for x86 with a gcc that can target
+   individual functions at sse2/avx2 and pick one at runtime */
+#if defined(__GNUC__) && (__GNUC__ >= 5) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_SIMD 1
+#else
+#define CHECKSUM_SIMD 0
+#endif
+
 /* the length of the md4 checksum */
 #define SUM_LENGTH 16
 
+/* the per block strong sums are cut down to about this many bits more
+   than the file size and block count call for, the whole file
+   checksum catches the rare false match that gets through */
+#define BLOCKSUM_BIAS 10
+
 #ifndef MAXPATHLEN
 #define MAXPATHLEN 1024
 #endif
@@ -140,6 +217,7 @@ struct file_struct {
 
 struct file_list {
   int count;
+  int malloced;
   struct file_struct *files;
 };
 
@@ -151,15 +229,47 @@ struct sum_buf {
   char sum2[SUM_LENGTH];	/* md4 checksum  */
 };
 
+/* how files are read, the -M option */
+#define READ_MMAP 0
+#define READ_PREAD 1
+
+/* the bytes of a -M read chunk let go of, as sorted start,end pairs */
+struct map_done {
+  int n, size;
+  int *r;
+};
+
+struct map_struct {
+  char *p;			/* the file's data, at its own offsets */
+  off_t size;
+  int fd;
+  char *have;			/* -M read: the chunks read in */
+  struct map_done *done;	/* -M read: what of each is let go of */
+  off_t ahead;			/* -M read: readahead asked for up to here */
+  int short_read;		/* -M read: the file was cut short */
+  pthread_mutex_t lock;
+};
+
 struct sum_struct {
   off_t flength;		/* total file length */ // buf总字节数
   int count;			/* how many chunks */ // 有多少个n字节块
   int remainder;		/* flength % block_length */ // 不足n字节的那个数据块有多少字节
   int n;			/* block_length */ // 按多少字节分数据块
+  int s2length;			/* bytes of each sum2 that are sent */
   struct sum_buf *sums;		/* points to info for each chunk */
 };
 
 
+/* where st_mtime is shorthand for st_mtim.tv_sec the nanoseconds are
+   there too */
+#ifdef st_mtime
+#define ST_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#define ST_CTIME_NSEC(st) ((st)->st_ctim.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st) 0
+#define ST_CTIME_NSEC(st) 0
+#endif
+
 #include "byteorder.h"
 #include "version.h"
 #include "proto.h"
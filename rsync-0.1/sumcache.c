@@ -0,0 +1,497 @@
+/*
+   Copyright (C) Andrew Tridgell 1996
+   Copyright (C) Paul Mackerras 1996
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+  the receiver's signature cache (-k dir)
+
+  The receiver sums each file it has just written, while it is still
+  in memory, and keeps the sums in dir, one file per inode. Those are
+  the next run's basis files, so the generator can then send their
+  sums without reading them if they have not changed in between.
+
+  An entry is a header holding what the sums depend on followed by
+  the sum_buf array exactly as it is in memory, so it can be mapped
+  and copied straight back. Entries are only used by the machine
+  that wrote them.
+
+  Each hit updates the entry's mtime. When the receiver is done, the
+  least recently used entries are removed until the cache is below
+  SUM_CACHE_SIZE bytes again.
+  */
+#include "rsync.h"
+
+extern int verbose;
+extern int cdc_chunking;
+extern char *sum_cache_dir;
+
+#define CACHE_MAGIC 0x52534332	/* "RSC2" */
+#define INDEX_MAGIC 0x52534931	/* "RSI1" */
+#define INDEX_NAME "file-sums"	/* the -c index, see below */
+
+struct cache_key {
+  uint32 magic;
+  uint32 sum_size;		/* sizeof(struct sum_buf) */
+  int n;			/* block size */
+  int cdc;			/* content defined chunks */
+  int64 dev, ino, size, mtime, ctime;
+  int64 mtime_nsec, ctime_nsec;	/* a change in the same second */
+};
+
+struct cache_header {
+  struct cache_key key;
+  int count;
+  int remainder;
+};
+
+static int cache_hits = 0;
+static int cache_misses = 0;
+static int made_dir = 0;
+
+static void cache_name(char *fname,struct stat *st)
+{
+  snprintf(fname,MAXPATHLEN,"%s/%lx.%lx",sum_cache_dir,
+	  (unsigned long)st->st_dev,(unsigned long)st->st_ino);
+}
+
+static void make_key(struct cache_key *key,struct stat *st,int n)
+{
+  bzero((char *)key,sizeof(*key));
+  key->magic = CACHE_MAGIC;
+  key->sum_size = sizeof(struct sum_buf);
+  key->n = n;
+  key->cdc = cdc_chunking;
+  key->dev = st->st_dev;
+  key->ino = st->st_ino;
+  key->size = st->st_size;
+  key->mtime = st->st_mtime;
+  key->ctime = st->st_ctime;
+  key->mtime_nsec = ST_MTIME_NSEC(st);
+  key->ctime_nsec = ST_CTIME_NSEC(st);
+}
+
+/*
+  return the sums of the file with stat st cut into blocks of n
+  bytes if the cache has them, otherwise NULL. The caller sets
+  s2length
+  */
+struct sum_struct *sum_cache_lookup(struct stat *st,int n)
+{
+  char fname[MAXPATHLEN];
+  struct cache_key key;
+  struct cache_header *h;
+  struct sum_struct *s = NULL;
+  struct stat st2;
+  struct map_struct *m;
+  char *map;
+  int fd;
+
+  if (!sum_cache_dir) return NULL;
+
+  cache_name(fname,st);
+  make_key(&key,st,n);
+
+  fd = open(fname,O_RDONLY);
+  if (fd == -1) goto miss;
+
+  if (fstat(fd,&st2) != 0 || st2.st_size < sizeof(*h)) {
+    close(fd);
+    goto miss;
+  }
+
+  m = map_file(fd,st2.st_size);
+  if (!m) {
+    close(fd);
+    goto miss;
+  }
+  map = map_ptr(m,0,st2.st_size);
+  close(fd);
+
+  h = (struct cache_header *)map;
+  if (memcmp(&h->key,&key,sizeof(key)) == 0 && h->count > 0 &&
+      st2.st_size == sizeof(*h) + (off_t)h->count*sizeof(struct sum_buf)) {
+    s = (struct sum_struct *)malloc(sizeof(*s));
+    if (!s) out_of_memory("sum_cache_lookup");
+    s->sums = (struct sum_buf *)malloc(sizeof(s->sums[0])*h->count);
+    if (!s->sums) out_of_memory("sum_cache_lookup");
+    bcopy(map+sizeof(*h),(char *)s->sums,sizeof(s->sums[0])*h->count);
+    s->flength = st->st_size;
+    s->count = h->count;
+    s->remainder = h->remainder;
+    s->n = n;
+  }
+  unmap_file(m);
+
+  if (!s) goto miss;
+
+  utime(fname,NULL);
+  cache_hits++;
+  if (verbose > 2)
+    fprintf(stderr,"signature cache hit %s\n",fname);
+  return s;
+
+miss:
+  cache_misses++;
+  return NULL;
+}
+
+/* drop the entry of a basis file that has been replaced */
+void sum_cache_remove(struct stat *st)
+{
+  char fname[MAXPATHLEN];
+
+  if (!sum_cache_dir) return;
+
+  cache_name(fname,st);
+  unlink(fname);
+}
+
+/*
+  save the sums of the file with stat st. The entry is written under
+  a temporary name and renamed so a reader never sees half of it
+  */
+void sum_cache_store(struct stat *st,struct sum_struct *s)
+{
+  char fname[MAXPATHLEN], tmpname[MAXPATHLEN];
+  struct cache_header h;
+  int fd, ok;
+
+  if (!sum_cache_dir || s->count == 0) return;
+
+  cache_name(fname,st);
+  if (snprintf(tmpname,sizeof(tmpname),"%s.tmp",fname) >= sizeof(tmpname))
+    return;
+
+  if (!made_dir) {
+    mkdir(sum_cache_dir,0700);
+    made_dir = 1;
+  }
+
+  fd = open(tmpname,O_WRONLY|O_CREAT|O_TRUNC,0600);
+  if (fd == -1) {
+    if (verbose > 1)
+      fprintf(stderr,"signature cache %s : %s\n",tmpname,strerror(errno));
+    return;
+  }
+
+  make_key(&h.key,st,s->n);
+  h.count = s->count;
+  h.remainder = s->remainder;
+
+  ok = write(fd,(char *)&h,sizeof(h)) == sizeof(h) &&
+    write(fd,(char *)s->sums,sizeof(s->sums[0])*s->count) ==
+    sizeof(s->sums[0])*s->count;
+  close(fd);
+
+  if (!ok || rename(tmpname,fname) != 0) {
+    if (verbose > 1)
+      fprintf(stderr,"failed to save signatures in %s\n",fname);
+    unlink(tmpname);
+  }
+}
+
+
+struct cache_entry {
+  char *name;
+  time_t used;
+  off_t size;
+};
+
+static int entry_compare(const void *p1,const void *p2)
+{
+  const struct cache_entry *e1 = p1, *e2 = p2;
+
+  if (e1->used < e2->used) return -1;
+  if (e1->used > e2->used) return 1;
+  return 0;
+}
+
+void sum_cache_report(void)
+{
+  if (sum_cache_dir && verbose > 1)
+    fprintf(stderr,"signature cache: %d hits %d misses\n",
+	    cache_hits,cache_misses);
+}
+
+/*
+  trim the cache to SUM_CACHE_SIZE bytes, dropping the entries least
+  recently used first
+  */
+void sum_cache_trim(void)
+{
+  DIR *d;
+  struct dirent *di;
+  struct stat st;
+  struct cache_entry *entries = NULL;
+  int i, count = 0, size = 0, evicted = 0;
+  int64 total = 0;
+  char fname[MAXPATHLEN];
+
+  if (!sum_cache_dir) return;
+
+  d = opendir(sum_cache_dir);
+  if (d) {
+    for (di=readdir(d); di; di=readdir(d)) {
+      if (di->d_name[0] == '.' ||
+	  strncmp(di->d_name,INDEX_NAME,strlen(INDEX_NAME)) == 0)
+	continue;
+      if (snprintf(fname,sizeof(fname),"%s/%s",sum_cache_dir,di->d_name) >=
+	  sizeof(fname) ||
+	  stat(fname,&st) != 0 || !S_ISREG(st.st_mode)) continue;
+      if (count == size) {
+	size = size ? size*2 : 256;
+	entries = (struct cache_entry *)realloc(entries,
+						sizeof(entries[0])*size);
+	if (!entries) out_of_memory("sum_cache_end");
+      }
+      entries[count].name = strdup(fname);
+      if (!entries[count].name) out_of_memory("sum_cache_end");
+      entries[count].used = st.st_mtime;
+      entries[count].size = st.st_size;
+      total += st.st_size;
+      count++;
+    }
+    closedir(d);
+  }
+
+  if (total > SUM_CACHE_SIZE) {
+    qsort(entries,count,sizeof(entries[0]),entry_compare);
+    for (i=0; i<count && total > SUM_CACHE_SIZE; i++) {
+      if (unlink(entries[i].name) == 0) {
+	total -= entries[i].size;
+	evicted++;
+      }
+    }
+  }
+
+  for (i=0;i<count;i++)
+    free(entries[i].name);
+  if (entries) free(entries);
+
+  if (verbose > 1 && evicted)
+    fprintf(stderr,"signature cache: %d entries evicted\n",evicted);
+}
+
+
+/*
+  the whole file checksums of -c are kept in an index, dir/file-sums,
+  shared by the sender and the receiver. It is a count followed by
+  file_sum records and is read into an open addressing table keyed
+  on device and inode the first time it is needed. A record is only
+  used if the size and the mtime, to the nanosecond, still match.
+
+  Records that have not been used for SUM_INDEX_AGE seconds are
+  dropped when the index is saved, which gets rid of deleted files.
+  */
+
+struct file_sum {
+  int64 dev, ino, size, mtime, mtime_nsec;
+  int64 used;			/* last lookup, 0 for an empty slot */
+  char sum[SUM_LENGTH];
+};
+
+static struct file_sum *index_table = NULL;
+static int index_size = 0;	/* slots, a power of 2 */
+static int index_count = 0;	/* slots in use */
+static int index_dirty = 0;
+static int index_loaded = 0;
+
+#define index_slot(dev,ino) \
+  ((uint32)((((uint64)(dev))*31 + (uint64)(ino)) * 0x9e3779b1ULL) & \
+   (index_size-1))
+
+static struct file_sum *index_find(int64 dev,int64 ino)
+{
+  uint32 j;
+
+  for (j=index_slot(dev,ino); index_table[j].used; j=(j+1)&(index_size-1))
+    if (index_table[j].dev == dev && index_table[j].ino == ino)
+      break;
+  return &index_table[j];
+}
+
+static void index_add(struct file_sum *rec)
+{
+  struct file_sum *old;
+  int i, size;
+
+  if (2*(index_count+1) > index_size) {
+    old = index_table;
+    size = index_size;
+    index_size = index_size ? index_size*2 : 1024;
+    index_table = (struct file_sum *)malloc(sizeof(old[0])*index_size);
+    if (!index_table) out_of_memory("index_add");
+    bzero((char *)index_table,sizeof(old[0])*index_size);
+    index_count = 0;
+    for (i=0;i<size;i++)
+      if (old[i].used)
+	index_add(&old[i]);
+    if (old) free(old);
+  }
+
+  old = index_find(rec->dev,rec->ino);
+  if (!old->used) index_count++;
+  *old = *rec;
+}
+
+/* add the records of the index on disk that the table does not
+   have yet */
+static void index_read(void)
+{
+  char fname[MAXPATHLEN];
+  struct stat st;
+  struct file_sum *recs;
+  struct map_struct *m;
+  char *map;
+  int fd, i, count;
+
+  snprintf(fname,sizeof(fname),"%s/%s",sum_cache_dir,INDEX_NAME);
+  fd = open(fname,O_RDONLY);
+  if (fd == -1) return;
+  if (fstat(fd,&st) != 0 || st.st_size < 8) {
+    close(fd);
+    return;
+  }
+  m = map_file(fd,st.st_size);
+  if (!m) {
+    close(fd);
+    return;
+  }
+  map = map_ptr(m,0,st.st_size);
+  close(fd);
+
+  count = IVAL(map,4);
+  if (IVAL(map,0) == INDEX_MAGIC &&
+      st.st_size == 8 + (off_t)count*sizeof(recs[0])) {
+    recs = (struct file_sum *)(map+8);
+    for (i=0;i<count;i++)
+      if (!index_table || !index_find(recs[i].dev,recs[i].ino)->used)
+	index_add(&recs[i]);
+  }
+  unmap_file(m);
+}
+
+/*
+  fill in sum for the file with stat st if the index has it. Returns
+  1 if it did
+  */
+int file_sum_lookup(struct stat *st,char *sum)
+{
+  struct file_sum *rec;
+  time_t t;
+
+  if (!sum_cache_dir) return 0;
+
+  if (!index_loaded) {
+    index_read();
+    index_loaded = 1;
+  }
+  if (!index_table) return 0;
+
+  rec = index_find(st->st_dev,st->st_ino);
+  if (!rec->used || rec->size != st->st_size ||
+      rec->mtime != st->st_mtime || rec->mtime_nsec != ST_MTIME_NSEC(st))
+    return 0;
+
+  bcopy(rec->sum,sum,SUM_LENGTH);
+
+  /* keep the index from being rewritten just to say a record was used */
+  t = time(NULL);
+  if (t - rec->used > SUM_INDEX_AGE/8) {
+    rec->used = t;
+    index_dirty = 1;
+  }
+  return 1;
+}
+
+void file_sum_store(struct stat *st,char *sum)
+{
+  struct file_sum rec;
+
+  if (!sum_cache_dir) return;
+
+  bzero((char *)&rec,sizeof(rec));
+  rec.dev = st->st_dev;
+  rec.ino = st->st_ino;
+  rec.size = st->st_size;
+  rec.mtime = st->st_mtime;
+  rec.mtime_nsec = ST_MTIME_NSEC(st);
+  rec.used = time(NULL);
+  bcopy(sum,rec.sum,SUM_LENGTH);
+  index_add(&rec);
+  index_dirty = 1;
+}
+
+/*
+  write the index back if it has changed. Records another process
+  saved since it was read are kept
+  */
+void file_sums_save(void)
+{
+  char fname[MAXPATHLEN], tmpname[MAXPATHLEN], hdr[8];
+  time_t t = time(NULL);
+  int fd, i, count, ok;
+
+  if (!sum_cache_dir || !index_dirty) return;
+
+  index_read();
+
+  count = 0;
+  for (i=0;i<index_size;i++)
+    if (index_table[i].used && t - index_table[i].used < SUM_INDEX_AGE)
+      index_table[count++] = index_table[i];
+
+  if (!made_dir) {
+    mkdir(sum_cache_dir,0700);
+    made_dir = 1;
+  }
+
+  snprintf(fname,sizeof(fname),"%s/%s",sum_cache_dir,INDEX_NAME);
+  if (snprintf(tmpname,sizeof(tmpname),"%s.%d",fname,(int)getpid()) >=
+      sizeof(tmpname))
+    return;
+  fd = open(tmpname,O_WRONLY|O_CREAT|O_TRUNC,0600);
+  if (fd == -1) {
+    if (verbose > 1)
+      fprintf(stderr,"checksum index %s : %s\n",tmpname,strerror(errno));
+    return;
+  }
+
+  SIVAL(hdr,0,INDEX_MAGIC);
+  SIVAL(hdr,4,count);
+  ok = write(fd,hdr,8) == 8 &&
+    write(fd,(char *)index_table,sizeof(index_table[0])*count) ==
+    sizeof(index_table[0])*count;
+  close(fd);
+
+  if (!ok || rename(tmpname,fname) != 0) {
+    if (verbose > 1)
+      fprintf(stderr,"failed to save checksum index %s\n",fname);
+    unlink(tmpname);
+  }
+
+  if (verbose > 1)
+    fprintf(stderr,"checksum index: %d files\n",count);
+
+  /* the table has been packed, start again if it is used any more */
+  free(index_table);
+  index_table = NULL;
+  index_size = index_count = 0;
+  index_dirty = 0;
+  index_loaded = 0;
+}
@@ -0,0 +1,381 @@
+/*
+   Copyright (C) Andrew Tridgell 1996
+   Copyright (C) Paul Mackerras 1996
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+  the token stream between the sender and the receiver. A token is
+  either a run of literal data or the number of a matched block.
+
+  Literal data is sent as a positive byte count followed by the
+  bytes and a block as -(i+1), with 0 ending the file. A run of
+  count blocks i, i+1, ... is sent as TOKEN_RUN, count, -(i+1), so
+  an unchanged stretch of file costs a few ints. With -z the
+  literal data of each file goes through one deflate stream instead
+  and the positive counts are the lengths of pieces of compressed
+  data. Each run is finished with a sync flush so the receiver has
+  all of it before the block that follows. A long stretch of literal
+  data may be handed over in several pieces, and only the last of
+  them is flushed.
+
+  Before a run is compressed, both ends load the matched data just
+  before it into the dictionary. The sender takes it from its own
+  file and the receiver from the blocks of the basis file it has
+  copied, so the stream history follows the file and not just the
+  literal data.
+
+  With -H a hole in the file is sent as TOKEN_HOLE and its length. It
+  ends a literal run like a block does, and counts as zeros in the
+  history.
+  */
+#include "rsync.h"
+#include <zlib.h>
+
+extern int do_compression;
+
+static int64 literal_data = 0;
+static int64 compressed_data = 0;
+
+int64 literal_total(void)
+{
+  return literal_data;
+}
+
+int64 compressed_total(void)
+{
+  return compressed_data;
+}
+
+/* a sync flush always ends with this empty stored block, so it is
+   left off the wire and put back by the receiver */
+static char sync_marker[4] = {0, 0, (char)0xff, (char)0xff};
+
+/* no block token can have this value */
+#define TOKEN_RUN (-0x7fffffff-1)
+
+/* the most history raw deflate keeps, with 15 window bits */
+#define MAX_DICT (32*1024)
+
+static z_stream tx_strm;
+static int tx_init_done = 0;
+static char *obuf = NULL;
+static off_t tx_last = 0;	/* end of the last literal run */
+static int tx_held = 0;		/* output bytes held back */
+static int tx_open = 0;		/* a run has been sent but not flushed */
+static int run_start, run_count = 0;	/* blocks not sent yet */
+
+static void deflate_init(void)
+{
+  tx_strm.zalloc = Z_NULL;
+  tx_strm.zfree = Z_NULL;
+  tx_strm.opaque = Z_NULL;
+  if (deflateInit2(&tx_strm,COMPRESS_LEVEL,Z_DEFLATED,
+		   -15,8,Z_DEFAULT_STRATEGY) != Z_OK) {
+    fprintf(stderr,"deflateInit2 failed\n");
+    exit(1);
+  }
+  obuf = (char *)malloc(CHUNK_SIZE+4);
+  if (!obuf) out_of_memory("deflate_init");
+  tx_init_done = 1;
+}
+
+/* compress a run of literal data and send it in pieces of at most
+   CHUNK_SIZE bytes. The last 4 bytes of output are always held back
+   so the sync marker can be dropped once the flush is done */
+static void send_deflated(int f,char *buf,int n,int flush)
+{
+  int len, r;
+
+  if (!tx_init_done) deflate_init();
+
+  tx_strm.next_in = (Bytef *)buf;
+  tx_strm.avail_in = n;
+  do {
+    tx_strm.next_out = (Bytef *)(obuf + tx_held);
+    tx_strm.avail_out = CHUNK_SIZE;
+    r = deflate(&tx_strm,flush);
+    if (r != Z_OK && r != Z_BUF_ERROR) {
+      fprintf(stderr,"deflate returned %d\n",r);
+      exit(1);
+    }
+    len = tx_held + CHUNK_SIZE - tx_strm.avail_out;
+    if (len > 4) {
+      write_int(f,len-4);
+      write_buf(f,obuf,len-4);
+      compressed_data += len-4;
+      memmove(obuf,obuf+len-4,4);
+      tx_held = 4;
+    } else {
+      tx_held = len;
+    }
+  } while (tx_strm.avail_out == 0);
+
+  if (flush == Z_SYNC_FLUSH)
+    tx_held = 0;
+}
+
+static void send_run(int f)
+{
+  if (run_count > 1) {
+    write_int(f,TOKEN_RUN);
+    write_int(f,run_count);
+  }
+  if (run_count > 0)
+    write_int(f,-(run_start+1));
+  run_count = 0;
+}
+
+/*
+  send the n bytes of literal data at offset in buf (n may be 0)
+  followed by token i, the number of a matched block or -1 for the
+  end of the file. i is -2 if more literal data follows straight on.
+  buf is the whole file, so the blocks matched since the last run
+  are the bytes just before offset
+  */
+void send_token(int f,int i,char *buf,off_t offset,int n)
+{
+  off_t start;
+
+  /* a block following on from the previous ones with nothing in
+     between just makes the run longer */
+  if (n == 0 && run_count > 0 && i == run_start+run_count) {
+    run_count++;
+    return;
+  }
+  send_run(f);
+
+  if (n > 0) {
+    literal_data += n;
+    if (do_compression) {
+      if (!tx_init_done) deflate_init();
+      if (offset > tx_last) {
+	start = MAX(tx_last,offset-MAX_DICT);
+	deflateSetDictionary(&tx_strm,(Bytef *)(buf+start),offset-start);
+      }
+      send_deflated(f,buf+offset,n,i == -2 ? Z_NO_FLUSH : Z_SYNC_FLUSH);
+      tx_open = (i == -2);
+      tx_last = offset+n;
+    } else {
+      write_int(f,n);
+      write_buf(f,buf+offset,n);
+      compressed_data += n;
+    }
+  }
+  if (i == -2)
+    return;
+  if (i != -1) {
+    run_start = i;
+    run_count = 1;
+    return;
+  }
+
+  write_int(f,0);
+  tx_last = 0;
+  if (tx_init_done)
+    deflateReset(&tx_strm);
+}
+
+/* send a hole of len bytes, straight after the literal data sent
+   with i == -2 or the last block */
+void send_hole(int f,off_t len)
+{
+  send_run(f);
+  if (tx_open) {
+    send_deflated(f,NULL,0,Z_SYNC_FLUSH);
+    tx_open = 0;
+  }
+  write_int(f,TOKEN_HOLE);
+  write_longint(f,len);
+}
+
+
+static z_stream rx_strm;
+static int rx_init_done = 0;
+static char *cbuf = NULL;	/* compressed input */
+static char *dbuf = NULL;	/* literal data handed back */
+static int rx_left = 0;		/* literal bytes still to read, no -z */
+static int rx_run = 0;		/* in a compressed run */
+static int rx_flushing = 0;	/* the sync marker has been fed in */
+static int rx_more = 0;		/* inflate has more output waiting */
+static int rx_token;		/* the token that ended the run */
+static int rx_skip = 0;		/* the stream is broken, drop it */
+static char *rx_dict = NULL;	/* matched data since the last run */
+static int rx_dict_len = 0;
+
+static void recv_init(void)
+{
+  cbuf = (char *)malloc(CHUNK_SIZE);
+  dbuf = (char *)malloc(CHUNK_SIZE);
+  rx_dict = (char *)malloc(MAX_DICT);
+  if (!cbuf || !dbuf || !rx_dict) out_of_memory("recv_init");
+  rx_strm.zalloc = Z_NULL;
+  rx_strm.zfree = Z_NULL;
+  rx_strm.opaque = Z_NULL;
+  rx_strm.next_in = Z_NULL;
+  rx_strm.avail_in = 0;
+  if (inflateInit2(&rx_strm,-15) != Z_OK) {
+    fprintf(stderr,"inflateInit2 failed\n");
+    exit(1);
+  }
+  rx_init_done = 1;
+}
+
+static int end_token(int i)
+{
+  if (i == 0) {
+    inflateReset(&rx_strm);
+    rx_dict_len = 0;
+    rx_skip = 0;
+  }
+  return i;
+}
+
+/*
+  the receiver has copied len bytes of a matched block from the
+  basis file. The last MAX_DICT bytes of these are kept to prime the
+  dictionary for the next literal run
+  */
+void see_token(char *data,int len)
+{
+  if (!do_compression) return;
+  if (!rx_init_done) recv_init();
+
+  if (len >= MAX_DICT) {
+    memcpy(rx_dict,data+len-MAX_DICT,MAX_DICT);
+    rx_dict_len = MAX_DICT;
+    return;
+  }
+  if (rx_dict_len + len > MAX_DICT) {
+    memmove(rx_dict,rx_dict+rx_dict_len+len-MAX_DICT,MAX_DICT-len);
+    rx_dict_len = MAX_DICT-len;
+  }
+  memcpy(rx_dict+rx_dict_len,data,len);
+  rx_dict_len += len;
+}
+
+/* the receiver has left a hole of len bytes */
+void see_hole(off_t len)
+{
+  static char zeros[MAX_DICT];
+
+  see_token(zeros,(int)MIN(len,MAX_DICT));
+}
+
+static int recv_deflated_token(int f,char **data)
+{
+  int i, n, r;
+
+  while (1) {
+    if (rx_strm.avail_in == 0 && !rx_more) {
+      if (rx_flushing) {
+	rx_flushing = 0;
+	return end_token(rx_token);
+      }
+      i = read_int(f);
+      if (i > 0) {
+	if (i > CHUNK_SIZE) {
+	  fprintf(stderr,"invalid compressed data length %d\n",i);
+	  exit(1);
+	}
+	read_buf(f,cbuf,i);
+	if (rx_skip) continue;
+	if (!rx_run && rx_dict_len) {
+	  inflateSetDictionary(&rx_strm,(Bytef *)rx_dict,rx_dict_len);
+	  rx_dict_len = 0;
+	}
+	rx_strm.next_in = (Bytef *)cbuf;
+	rx_strm.avail_in = i;
+	rx_run = 1;
+      } else if (rx_run) {
+	memcpy(cbuf,sync_marker,4);
+	rx_strm.next_in = (Bytef *)cbuf;
+	rx_strm.avail_in = 4;
+	rx_run = 0;
+	rx_flushing = 1;
+	rx_token = i;
+      } else {
+	return end_token(i);
+      }
+    }
+
+    rx_strm.next_out = (Bytef *)dbuf;
+    rx_strm.avail_out = CHUNK_SIZE;
+    r = inflate(&rx_strm,Z_SYNC_FLUSH);
+    if (r == Z_DATA_ERROR) {
+      /* the history did not match the sender's, the whole file
+	 checksum will fail and the file will be redone */
+      rx_skip = 1;
+      rx_run = 0;
+      rx_more = 0;
+      rx_strm.avail_in = 0;
+      continue;
+    }
+    if (r != Z_OK && r != Z_BUF_ERROR) {
+      fprintf(stderr,"inflate returned %d\n",r);
+      exit(1);
+    }
+    rx_more = (rx_strm.avail_out == 0);
+    n = CHUNK_SIZE - rx_strm.avail_out;
+    if (n > 0) {
+      *data = dbuf;
+      return n;
+    }
+  }
+}
+
+static int simple_recv_token(int f,char **data)
+{
+  int n;
+
+  if (rx_left == 0) {
+    n = read_int(f);
+    if (n <= 0) return n;
+    rx_left = n;
+  }
+  n = MIN(rx_left,CHUNK_SIZE);
+  read_buf(f,dbuf,n);
+  rx_left -= n;
+  *data = dbuf;
+  return n;
+}
+
+/*
+  receive the next token. A positive return is that many bytes of
+  literal data, left in *data until the next call. Otherwise it is
+  -(i+1) for a run of *nblocks blocks starting at block i, TOKEN_HOLE
+  for a hole of *hole bytes, or 0 at the end of the file
+  */
+int recv_token(int f,char **data,int *nblocks,off_t *hole)
+{
+  int i;
+
+  if (!rx_init_done) recv_init();
+
+  if (do_compression)
+    i = recv_deflated_token(f,data);
+  else
+    i = simple_recv_token(f,data);
+
+  *nblocks = 1;
+  if (i == TOKEN_RUN) {
+    *nblocks = read_int(f);
+    i = read_int(f);
+  } else if (i == TOKEN_HOLE) {
+    *hole = read_longint(f);
+  }
+  return i;
+}
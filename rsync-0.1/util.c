@@ -24,43 +24,100 @@
   */
 #include "rsync.h"
 
-static int total_written = 0;
-static int total_read = 0;
+static int64 total_written = 0;
+static int64 total_read = 0;
 
 extern int verbose;
+extern int read_mode;
 
-int write_total(void)
+int64 write_total(void)
 {
   return total_written;
 }
 
-int read_total(void)
+int64 read_total(void)
 {
   return total_read;
 }
 
-void write_int(int f,int x)
+
+/*
+  output is buffered per fd so that the many small write_int() calls
+  made while sending file lists, checksums and tokens turn into a
+  few large writes. Nothing reaches the fd until write_flush() is
+  called or the buffer fills up.
+  */
+static char io_buffer[IO_BUFFER_SIZE];
+static int io_buffer_count = 0;
+static int io_buffer_fd = -1;
+
+static void writefd(int fd,char *buf,int len)
 {
-  char b[4];
-  SIVAL(b,0,x);
-  if (write(f,b,4) != 4) {
-    fprintf(stderr,"write_int failed : %s\n",strerror(errno));
-    exit(1);
+  int ret;
+  int total = 0;
+
+  while (total < len) {
+    ret = write(fd,buf+total,len-total);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret <= 0) {
+      fprintf(stderr,"write failed : %s\n",
+	      ret==0?"short write":strerror(errno));
+      exit(1);
+    }
+    total += ret;
   }
-  total_written += 4;
 }
 
-void write_buf(int f,char *buf,int len)
+void write_flush(int f)
 {
-  if (write(f,buf,len) != len) {
-    fprintf(stderr,"write_buf failed : %s\n",strerror(errno));
-    exit(1);
+  if (io_buffer_count == 0) return;
+  writefd(io_buffer_fd,io_buffer,io_buffer_count);
+  io_buffer_count = 0;
+}
+
+static void write_bytes(int f,char *buf,int len)
+{
+  if (io_buffer_count && io_buffer_fd != f)
+    write_flush(io_buffer_fd);
+  io_buffer_fd = f;
+
+  if (io_buffer_count + len > IO_BUFFER_SIZE) {
+    write_flush(f);
+    if (len > IO_BUFFER_SIZE/2) {
+      /* big buffers go straight out */
+      writefd(f,buf,len);
+      total_written += len;
+      return;
+    }
   }
+
+  bcopy(buf,io_buffer+io_buffer_count,len);
+  io_buffer_count += len;
   total_written += len;
 }
 
-void write_flush(int f)
+void write_int(int f,int x)
+{
+  char b[4];
+  SIVAL(b,0,x);
+  write_bytes(f,b,4);
+}
+
+/* 64 bit values (file lengths, times and totals) go as two ints, the
+   low half first */
+void write_longint(int f,int64 x)
+{
+  char b[8];
+  uint32 lo = (uint32)x, hi = (uint32)(x >> 32);
+  SIVAL(b,0,lo);
+  SIVAL(b,4,hi);
+  write_bytes(f,b,8);
+}
+
+void write_buf(int f,char *buf,int len)
 {
+  write_bytes(f,buf,len);
 }
 
 
@@ -68,6 +125,10 @@ int readfd(int fd,char *buffer,int N)
 {
   int  ret;
   int total=0;  
+
+  /* don't leave the other end waiting on output we are holding */
+  if (io_buffer_count)
+    write_flush(io_buffer_fd);
  
   while (total < N)
     {
@@ -81,39 +142,334 @@ int readfd(int fd,char *buffer,int N)
 }
 
 
-int read_int(int f)
+/*
+  input is buffered the same way: the buffer is refilled with
+  whatever is available on the fd (at least as much as the caller
+  needs) and ints and buffers are decoded straight out of it. The
+  buffer belongs to one fd at a time, it can only move to another
+  fd once it has been drained.
+  */
+static char read_buffer[IO_BUFFER_SIZE];
+static int read_buffer_pos = 0;
+static int read_buffer_len = 0;
+static int read_buffer_fd = -1;
+
+static void read_error(int len)
 {
-  char b[4];
-  if (readfd(f,b,4) != 4) {
-    if (verbose > 1) 
-      fprintf(stderr,"Error reading %d bytes : %s\n",4,strerror(errno));
-    exit(1);
+  if (verbose > 1) 
+    fprintf(stderr,"Error reading %d bytes : %s\n",len,strerror(errno));
+  exit(1);
+}
+
+static void fill_buffer(int f,int len)
+{
+  int ret;
+
+  if (read_buffer_pos > 0) {
+    if (read_buffer_len)
+      memmove(read_buffer,read_buffer+read_buffer_pos,read_buffer_len);
+    read_buffer_pos = 0;
+  }
+
+  if (io_buffer_count)
+    write_flush(io_buffer_fd);
+
+  while (read_buffer_len < len) {
+    ret = read(f,read_buffer+read_buffer_len,
+	       IO_BUFFER_SIZE-read_buffer_len);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      read_error(len);
+    read_buffer_len += ret;
   }
-  total_read += 4;
+}
+
+/*
+  return a pointer to the next len bytes from f, len must be no more
+  than IO_BUFFER_SIZE. The data is only valid until the next read
+  */
+char *read_ptr(int f,int len)
+{
+  char *ret;
+
+  if (read_buffer_fd != f) {
+    if (read_buffer_len) {
+      fprintf(stderr,"read_ptr: input still buffered for fd %d\n",
+	      read_buffer_fd);
+      exit(1);
+    }
+    read_buffer_fd = f;
+  }
+
+  if (read_buffer_len < len)
+    fill_buffer(f,len);
+
+  ret = read_buffer + read_buffer_pos;
+  read_buffer_pos += len;
+  read_buffer_len -= len;
+  total_read += len;
+  return ret;
+}
+
+int read_int(int f)
+{
+  char *b = read_ptr(f,4);
   return IVAL(b,0);
 }
 
+int64 read_longint(int f)
+{
+  char *b = read_ptr(f,8);
+  return (int64)(uint32)IVAL(b,0) | ((int64)(uint32)IVAL(b,4) << 32);
+}
+
 void read_buf(int f,char *buf,int len)
 {
-  if (readfd(f,buf,len) != len) {
-    if (verbose > 1) 
-      fprintf(stderr,"Error reading %d bytes : %s\n",len,strerror(errno));
-    exit(1);
+  int n;
+
+  n = (read_buffer_fd == f) ? MIN(len,read_buffer_len) : 0;
+  if (n) {
+    bcopy(read_ptr(f,n),buf,n);
+    buf += n;
+    len -= n;
+  }
+
+  if (len > IO_BUFFER_SIZE/2) {
+    /* big reads bypass the buffer */
+    if (readfd(f,buf,len) != len)
+      read_error(len);
+    total_read += len;
+  } else if (len > 0) {
+    bcopy(read_ptr(f,len),buf,len);
   }
-  total_read += len;
 }
 
 
-char *map_file(int fd,off_t len)
+/*
+  the whole of a file for the passes over it. With -M mmap (the
+  default) it is mapped and the pages come in as they are touched.
+  With -M read it is read with pread into private memory a READ_CHUNK
+  at a time as map_ptr() asks for it, and the kernel is asked to start
+  on the next READ_AHEAD bytes each time, so the reads are in flight
+  while the data before them is worked on. That way a slow network
+  file system stalls one read rather than every page fault, and a file
+  that is cut short while it is being read gives zeros instead of a
+  SIGBUS.
+
+  Returns NULL if the file can't be mapped
+  */
+struct map_struct *map_file(int fd,off_t len)
 {
-  char *ret = (char *)mmap(NULL,len,PROT_READ,MAP_SHARED,fd,0);
-  return ret;
+  struct map_struct *map;
+
+  map = (struct map_struct *)malloc(sizeof(*map));
+  if (!map) out_of_memory("map_file");
+  bzero(map,sizeof(*map));
+  map->fd = fd;
+  map->size = len;
+
+  if (len == 0)
+    return map;
+
+  if (read_mode == READ_MMAP) {
+    map->p = (char *)mmap(NULL,len,PROT_READ,MAP_SHARED,fd,0);
+  } else {
+    map->p = (char *)mmap(NULL,len,PROT_READ|PROT_WRITE,
+			  MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    map->have = (char *)calloc((len+READ_CHUNK-1)/READ_CHUNK,1);
+    map->done = (struct map_done *)calloc((len+READ_CHUNK-1)/READ_CHUNK,
+					  sizeof(struct map_done));
+    if (!map->have || !map->done) out_of_memory("map_file");
+    pthread_mutex_init(&map->lock,NULL);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+#endif
+  }
+
+  if (map->p == (char *)MAP_FAILED) {
+    if (map->have) free(map->have);
+    if (map->done) free(map->done);
+    free(map);
+    return NULL;
+  }
+  return map;
+}
+
+/* read chunk c of a -M read map. What can't be read is left as zeros */
+static void read_chunk(struct map_struct *map,off_t c)
+{
+  off_t offset = c*READ_CHUNK;
+  int len = MIN(map->size-offset,READ_CHUNK);
+  int n, got = 0;
+
+  while (got < len) {
+    n = pread(map->fd,map->p+offset+got,len-got,offset+got);
+    if (n <= 0) {
+      if (!map->short_read)
+	fprintf(stderr,"file shrank or can't be read at %.0f : %s\n",
+		(double)(offset+got),n?strerror(errno):"end of file");
+      map->short_read = 1;
+      bzero(map->p+offset+got,len-got);
+      break;
+    }
+    got += n;
+  }
+  map->have[c] = 1;
+  map->done[c].n = 0;
+
+#ifdef POSIX_FADV_WILLNEED
+  /* once the reads get within half of it, ask for the next
+     READ_AHEAD bytes after what has been asked for */
+  if (offset+len+READ_AHEAD/2 > map->ahead && map->ahead < map->size) {
+    map->ahead = MAX(map->ahead,offset+len);
+    posix_fadvise(map->fd,map->ahead,READ_AHEAD,POSIX_FADV_WILLNEED);
+    map->ahead += READ_AHEAD;
+  }
+#endif
+}
+
+/*
+  add (add != 0) or take away the bytes start..end-1 of a chunk from
+  those let go of. The pairs are rebuilt with any that touch the range
+  merged into it or cut back from it
+  */
+static void done_update(struct map_done *d,int start,int end,int add)
+{
+  int *r, i, n = 0, placed = 0;
+
+  /* the usual case, a pass going forwards through the chunk */
+  if (add && d->n && d->r[2*d->n-2] <= start && start <= d->r[2*d->n-1]) {
+    d->r[2*d->n-1] = MAX(d->r[2*d->n-1],end);
+    return;
+  }
+
+  if (!add) {
+    for (i=0;i<d->n;i++)
+      if (d->r[2*i] < end && d->r[2*i+1] > start) break;
+    if (i == d->n) return;
+  }
+
+  /* there is at most one more pair afterwards */
+  if (d->n + 1 > d->size)
+    d->size = d->n + 8;
+  r = (int *)malloc(sizeof(int)*2*d->size);
+  if (!r) out_of_memory("done_update");
+
+  for (i=0;i<d->n;i++) {
+    int s = d->r[2*i], e = d->r[2*i+1];
+    if (e < start || s > end) {
+      if (add && s > end && !placed) {
+	r[2*n] = start; r[2*n+1] = end; n++;
+	placed = 1;
+      }
+      r[2*n] = s; r[2*n+1] = e; n++;
+    } else if (add) {
+      start = MIN(start,s);
+      end = MAX(end,e);
+    } else {
+      if (s < start) {
+	r[2*n] = s; r[2*n+1] = start; n++;
+      }
+      if (e > end) {
+	r[2*n] = end; r[2*n+1] = e; n++;
+      }
+    }
+  }
+  if (add && !placed) {
+    r[2*n] = start; r[2*n+1] = end; n++;
+  }
+
+  free(d->r);
+  d->r = r;
+  d->n = n;
 }
 
-void unmap_file(char *buf,off_t len)
+/*
+  the len bytes of the file at offset, read in first if need be. The
+  data stays there until it is let go of with map_release(), even if
+  the same bytes were let go of before. The -j threads may call this
+  at the same time
+  */
+char *map_ptr(struct map_struct *map,off_t offset,off_t len)
 {
-  if (len > 0)
-    munmap(buf,len);
+  off_t c;
+
+  if (!map->have || len <= 0)
+    return map->p+offset;
+
+  pthread_mutex_lock(&map->lock);
+  for (c=offset/READ_CHUNK; c<=(offset+len-1)/READ_CHUNK; c++) {
+    if (!map->have[c]) {
+      read_chunk(map,c);
+    } else if (map->done[c].n) {
+      done_update(&map->done[c],
+		  MAX(offset,c*READ_CHUNK) - c*READ_CHUNK,
+		  MIN(offset+len,(c+1)*READ_CHUNK) - c*READ_CHUNK,0);
+    }
+  }
+  pthread_mutex_unlock(&map->lock);
+
+  return map->p+offset;
+}
+
+/*
+  a file is mapped whole, but the passes over it let go of the data
+  they are done with as they go so a file much bigger than memory
+  doesn't all become resident. Only the whole pages inside the range
+  go; a page comes back from the page cache if it is touched again.
+  With -M read a chunk goes once all of its bytes have been let go
+  of, whoever by, and map_ptr() reads it again if it is wanted after
+  that. Bytes let go of more than once only count once
+  */
+void map_release(struct map_struct *map,off_t offset,off_t len)
+{
+  static long pagesize = 0;
+  off_t start, end, c;
+
+  if (len <= 0) return;
+
+  if (!map->have) {
+    if (!pagesize) pagesize = sysconf(_SC_PAGESIZE);
+    start = (offset + pagesize-1) & ~(off_t)(pagesize-1);
+    end = (offset + len) & ~(off_t)(pagesize-1);
+    if (end > start)
+      madvise(map->p+start,end-start,MADV_DONTNEED);
+    return;
+  }
+
+  pthread_mutex_lock(&map->lock);
+  for (c=offset/READ_CHUNK; c<=(offset+len-1)/READ_CHUNK; c++) {
+    struct map_done *d = &map->done[c];
+    int clen = MIN(map->size-c*READ_CHUNK,READ_CHUNK);
+
+    if (!map->have[c]) continue;
+    start = MAX(offset,c*READ_CHUNK);
+    end = MIN(offset+len,(c+1)*READ_CHUNK);
+    done_update(d,start-c*READ_CHUNK,end-c*READ_CHUNK,1);
+    if (d->n == 1 && d->r[0] == 0 && d->r[1] >= clen) {
+      madvise(map->p+c*READ_CHUNK,clen,MADV_DONTNEED);
+      map->have[c] = 0;
+      d->n = 0;
+    }
+  }
+  pthread_mutex_unlock(&map->lock);
+}
+
+void unmap_file(struct map_struct *map)
+{
+  if (!map) return;
+  if (map->size > 0)
+    munmap(map->p,map->size);
+  if (map->have) {
+    off_t c;
+    for (c=0;c<(map->size+READ_CHUNK-1)/READ_CHUNK;c++)
+      if (map->done[c].r) free(map->done[c].r);
+    free(map->have);
+    free(map->done);
+    pthread_mutex_destroy(&map->lock);
+  }
+  free(map);
 }
 
 